@@ -1,5 +1,4 @@
 const {Cc, Ci} = require("chrome");
-var clipboard = require("sdk/clipboard");
 var data = require("sdk/self").data;
 
 // Create a button
@@ -31,7 +30,6 @@ function handleClick(state) {
     // textual representation of the actual full URL displayed in the browser
     var url = uri.spec;
 
-    clipboard.set(url);
     console.log(url);
 
     var process = Cc["@mozilla.org/process/util;1"]
@@ -42,6 +40,9 @@ function handleClick(state) {
     // same place.
     file.initWithPath("/home/kaan/programming/c/pastor/pastor");
     process.init(file);
-    var parameters = ["-p", "asd", "/home/kaan/programming/c/pastor/database.db", url];
+    // pastor copies the password to the clipboard and clears it again after
+    // 30 seconds.
+    var parameters = ["-p", "asd", "--output", "clipboard", "--clear", "30",
+        "/home/kaan/programming/c/pastor/database.db", url];
     process.run(true, parameters, parameters.length);
 }
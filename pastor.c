@@ -2,31 +2,108 @@
 
 #include <gcrypt.h>
 #include <argtable2.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
+#include <linux/keyctl.h>
 
 #define DEBUG 0
-#define BUFFER_SIZE 16
-#define KEY_SIZE 16 // We use 128-bit key.
+#define BUFFER_SIZE 4096 // Multiple of the block size of every backend.
+#define MAX_KEY_SIZE 32
+#define IV_SIZE 12
+#define TAG_SIZE 16
+#define VAULT_MAGIC "pastor-vault"
 #define VERSION "0.1-dev"
 #define MIN_LENGTH 48
 #define MAX_LENGTH 64
+#define DOMAIN_SIZE 128 // Including the terminating NUL.
+#define MAX_VAULTS 16
 #define NO_DIGIT_FLAG 0b01
 #define NO_SPECIAL_CHARACTER_FLAG 0b10
-
-// The key which are used for symmetrical encryption/decryption
+#define HISTORY_SIZE 5
+#define DAY (24 * 60 * 60)
+#define TOMBSTONE_AGE (90 * DAY) // Seconds tombstones are kept.
+#define DEFAULT_SPECIAL_CHARACTERS "<>[](){}~&\"!?%/"
+#define WEAK_ENTROPY 80
+#define FORMAT_LIST 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+#define CODEC_PLAIN 0
+#define CODEC_FRONT 1
+
+// The password given by the user and the key derived from it which are used
+// for symmetrical encryption/decryption. The key is derived for the backend
+// in key_backend, see derive_key. The password is only asked for when there is
+// no key in the key cache.
+char* passphrase;
 char* key;
+int passphrase_read;
+int key_cached;
+
+/**
+ * A cipher the database can be encrypted with.
+ *
+ * Data is processed in multiples of block_size. Backends without AEAD pad the
+ * last block with zeros, AEAD backends store an IV and an authentication tag
+ * so a wrong key or a tampered database is detected.
+ */
+struct cipher_backend
+{
+    const char* name;
+    int algorithm;
+    int mode;
+    int key_digest;
+    size_t key_size;
+    size_t block_size;
+    int aead;
+};
+
+// Databases without a plain text header are encrypted with the first backend.
+// The AES backends use AES-NI or ARMv8-CE through libgcrypt when available.
+const struct cipher_backend cipher_backends[] = {
+    {"blowfish-ecb", GCRY_CIPHER_BLOWFISH, GCRY_CIPHER_MODE_ECB, GCRY_MD_MD5,
+        16, 16, 0},
+    {"aes128-gcm", GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_GCM, GCRY_MD_MD5,
+        16, 16, 1},
+    {"aes256-gcm", GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, GCRY_MD_SHA256,
+        32, 16, 1},
+};
+#define DEFAULT_BACKEND (&cipher_backends[1])
+
+// The backend of the database, new databases use DEFAULT_BACKEND.
+const struct cipher_backend* backend = DEFAULT_BACKEND;
+const struct cipher_backend* key_backend;
+
+// The random number and version counter found in the header of the database.
+// The version counter is increased for every change and each record stores the
+// version it was last written at, see add_to_database.
+int database_random;
+long database_version;
+
+// How the records are encoded before encryption, named in the header.
+int database_codec = CODEC_PLAIN;
+const char* codec_names[] = {"plain", "front"};
 
-// Blow fish to maybe provide editing via vim
-// TODO: Make this changeable.
-int algorithm = GCRY_CIPHER_BLOWFISH;
-int mode = GCRY_CIPHER_MODE_ECB;
 FILE* tmp_file;
 
+// The plain text of the vaults given with the vault option, which are searched
+// after the database in this order. Only the database is ever written.
+FILE** overlay_files;
+int nr_overlay_files;
+
 // Here follows the input arguments that are provided by the user.
 //
 // The reason we define them here is that this way we can use them in all
@@ -35,8 +112,15 @@ struct arg_lit* generate;
 struct arg_lit* help;
 struct arg_lit* version;
 struct arg_lit* create_new;
+struct arg_lit* list;
+struct arg_str* export_format;
+struct arg_lit* audit;
+struct arg_lit* compress;
 struct arg_lit* force;
+struct arg_lit* delete;
+struct arg_lit* history;
 struct arg_file* output_file;
+struct arg_file* vaults;
 struct arg_str* domain;
 struct arg_str* import;
 struct arg_str* allowed_special_characters;
@@ -48,9 +132,38 @@ struct arg_int* number_of_digits;
 struct arg_int* number_of_special_characters;
 struct arg_lit* no_digits;
 struct arg_lit* no_special_characters;
+struct arg_int* max_age;
+struct arg_lit* rotate;
 struct arg_str* database_password;
+struct arg_int* cache_ttl;
+struct arg_lit* lock;
+struct arg_str* output_sink;
+struct arg_int* clear_after;
+struct arg_str* cipher;
+struct arg_str* rekey;
+struct arg_file* sync_export;
+struct arg_file* sync_merge;
+struct arg_int* since;
 struct arg_end* end;
 
+/**
+ * The requirements on generated passwords. Sizes of -1 use the defaults
+ * MIN_LENGTH and MAX_LENGTH and a len_of_special_chars of -1 uses
+ * DEFAULT_SPECIAL_CHARACTERS.
+ */
+struct password_options
+{
+    int min_size;
+    int max_size;
+    int number_of_uppercase;
+    int number_of_lowercase;
+    int number_of_digits;
+    int number_of_special_characters;
+    int len_of_special_chars;
+    char* special_characters;
+    int flag;
+};
+
 /**
  * Initializes the libgcrypt library.
  *
@@ -90,18 +203,30 @@ int init_libgcrypt()
  *
  * The input char pointer is used to parse away the protocol and the parameters.
  * This way https://www.google.com/blabla?blabla is parsed as www.google.com
+ *
+ * out_domain has to hold DOMAIN_SIZE characters, longer domains are rejected.
  */
 int get_domain(const char* domain, char* out_domain)
 {
     char* protocol = strstr(domain, "//");
+    size_t length;
 
     if (protocol == NULL)
     {
         fprintf(stderr, "Malformed domain. Could not find the protocol.\n");
         return EXIT_FAILURE;
     }
-    if ((sscanf(protocol, "//%[^/]", out_domain)) == EOF
-            || !(strcmp(out_domain, "")))
+    protocol += 2;
+    length = strcspn(protocol, "/");
+    if (length >= DOMAIN_SIZE)
+    {
+        fprintf(stderr, "Too long domain in %s.\n", domain);
+        return EXIT_FAILURE;
+    }
+    memcpy(out_domain, protocol, length);
+    out_domain[length] = '\0';
+    // Spaces and newlines would break the records of the database.
+    if (!length || out_domain[strcspn(out_domain, " \t\r\n")])
     {
         fprintf(stderr, "Could not find the domain from %s.\n", domain);
         return EXIT_FAILURE;
@@ -110,45 +235,222 @@ int get_domain(const char* domain, char* out_domain)
 }
 
 /**
- * Prompts the user for the key to decrypt the database.
+ * Sets up the key. The password is taken from the options to the program if
+ * given, otherwise it is asked for by derive_key when needed.
  */
 int get_key()
 {
-    key = (char*) calloc(sizeof(char), KEY_SIZE);
+    passphrase = (char*) calloc(sizeof(char), MAX_KEY_SIZE + 1);
+    key = (char*) calloc(sizeof(char), MAX_KEY_SIZE);
+    key_backend = NULL;
+    key_cached = 0;
+    passphrase_read = 0;
 
     if (database_password->count > 0)
     {
-        strncpy(key, database_password->sval[0], KEY_SIZE);
+        strncpy(passphrase, database_password->sval[0], MAX_KEY_SIZE);
+        passphrase_read = 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Prompts the user for the password to decrypt the database filename. The
+ * filename is only shown when several vaults are opened.
+ */
+void read_passphrase(const char* filename)
+{
+    struct termios oldt, newt;
+    int i = 0;
+    int c;
+
+    memset(passphrase, 0, MAX_KEY_SIZE + 1);
+
+    // Disables printing of password back to the user.
+    tcgetattr(STDIN_FILENO, &oldt);
+    newt = oldt;
+    newt.c_lflag &= ~(ECHO);
+    tcsetattr( STDIN_FILENO, TCSANOW, &newt);
+
+    if (vaults->count > 0)
+    {
+        printf("Enter key for %s: ", filename);
     }
     else
     {
-        struct termios oldt, newt;
-        int i = 0;
-        int c;
+        printf("Enter key: ");
+    }
+    while ((c = getchar()) != '\n' && c != EOF && i < MAX_KEY_SIZE)
+    {
+        passphrase[i++] = c;
+    }
 
-        // Disables printing of password back to the user.
-        tcgetattr(STDIN_FILENO, &oldt);
-        newt = oldt;
-        newt.c_lflag &= ~(ECHO);
-        tcsetattr( STDIN_FILENO, TCSANOW, &newt);
+    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
 
-        printf("Enter key: ");
-        while ((c = getchar()) != '\n' && c != EOF && i < KEY_SIZE)
+    printf("\n");
+    passphrase_read = 1;
+}
+
+/**
+ * Writes the description of the key for cipher and the database filename in
+ * the key cache to description.
+ */
+void key_description(char* description, size_t size,
+        const struct cipher_backend* cipher, const char* filename)
+{
+    char* path = realpath(filename, NULL);
+    snprintf(description, size, "pastor:%s:%s", cipher->name,
+            path ? path : filename);
+    free(path);
+}
+
+/**
+ * Finds the keyring of the kernel keys are cached in. This is the session
+ * keyring, or the user session keyring when the process does not belong to a
+ * session with a keyring. The kernel then falls back to the user session
+ * keyring for lookups but would add keys to a new session keyring which only
+ * lives as long as the process.
+ */
+long cache_keyring()
+{
+    long session = syscall(SYS_keyctl, KEYCTL_GET_KEYRING_ID,
+            KEY_SPEC_SESSION_KEYRING, 0);
+    long user_session = syscall(SYS_keyctl, KEYCTL_GET_KEYRING_ID,
+            KEY_SPEC_USER_SESSION_KEYRING, 0);
+
+    if (session >= 0 && session != user_session)
+    {
+        return KEY_SPEC_SESSION_KEYRING;
+    }
+    return KEY_SPEC_USER_SESSION_KEYRING;
+}
+
+/**
+ * Looks up the key for cipher and the database filename in the key cache.
+ *
+ * Returns 1 and fills key if it is cached.
+ */
+int load_cached_key(const struct cipher_backend* cipher, const char* filename)
+{
+    char description[PATH_MAX + 64];
+    long id;
+
+    key_description(description, sizeof(description), cipher, filename);
+    id = syscall(SYS_keyctl, KEYCTL_SEARCH, cache_keyring(), "user",
+            description, 0);
+    return id >= 0 && syscall(SYS_keyctl, KEYCTL_READ, id, key,
+            cipher->key_size) == (long) cipher->key_size;
+}
+
+/**
+ * Updates the key cache after cipher_key for cipher was checked against
+ * filename. A valid key is stored for the number of seconds given by the cache
+ * option, a wrong key which came from the cache is removed from it.
+ */
+void update_key_cache(const char* filename,
+        const struct cipher_backend* cipher, const char* cipher_key,
+        int cached, int valid)
+{
+    char description[PATH_MAX + 64];
+    long id;
+
+    if (!cipher || (valid && cache_ttl->count == 0) || (!valid && !cached))
+    {
+        return;
+    }
+
+    key_description(description, sizeof(description), cipher, filename);
+    if (valid)
+    {
+        id = syscall(SYS_add_key, "user", description, cipher_key,
+                cipher->key_size, cache_keyring());
+        if (id < 0 || syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, id,
+                    cache_ttl->ival[0]) < 0)
         {
-            key[i++] = c;
+            fprintf(stderr, "Could not cache the key.\n");
         }
+    }
+    else if ((id = syscall(SYS_keyctl, KEYCTL_SEARCH, cache_keyring(),
+                    "user", description, 0)) >= 0)
+    {
+        syscall(SYS_keyctl, KEYCTL_REVOKE, id);
+    }
+}
 
-        tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-
-        printf("\n");
+/**
+ * Derives the key for cipher from the password by hashing it 1000 times. Only
+ * the first key_size characters of the password are used.
+ *
+ * Unless the password was given on the command line a key for filename in the
+ * key cache is used instead, which skips both the prompt and the hashing.
+ */
+void derive_key(const struct cipher_backend* cipher, const char* filename)
+{
+    if (key_backend && key_backend->key_size == cipher->key_size &&
+            key_backend->key_digest == cipher->key_digest)
+    {
+        return;
+    }
+    if (!passphrase_read && load_cached_key(cipher, filename))
+    {
+        key_backend = cipher;
+        key_cached = 1;
+        return;
+    }
+    if (!passphrase_read)
+    {
+        read_passphrase(filename);
     }
+    memset(key, 0, MAX_KEY_SIZE);
+    memcpy(key, passphrase, cipher->key_size);
     for (int it = 0; it < 1000; ++it)
     {
-        gcry_md_hash_buffer(GCRY_MD_MD5, key, key, KEY_SIZE);
+        gcry_md_hash_buffer(cipher->key_digest, key, key, cipher->key_size);
+    }
+    key_backend = cipher;
+    key_cached = 0;
+}
+
+/**
+ * Removes the keys for the database filename from the key cache.
+ */
+int forget_key(const char* filename)
+{
+    char description[PATH_MAX + 64];
+    long id;
+
+    for (size_t i = 0;
+            i < sizeof(cipher_backends) / sizeof(cipher_backends[0]); i++)
+    {
+        key_description(description, sizeof(description), &cipher_backends[i],
+                filename);
+        if ((id = syscall(SYS_keyctl, KEYCTL_SEARCH, cache_keyring(),
+                        "user", description, 0)) >= 0)
+        {
+            syscall(SYS_keyctl, KEYCTL_REVOKE, id);
+        }
     }
     return EXIT_SUCCESS;
 }
 
+/**
+ * Finds the cipher backend called name.
+ *
+ * Returns NULL if there is no such backend.
+ */
+const struct cipher_backend* find_backend(const char* name)
+{
+    for (size_t i = 0;
+            i < sizeof(cipher_backends) / sizeof(cipher_backends[0]); i++)
+    {
+        if (!strcmp(cipher_backends[i].name, name))
+        {
+            return &cipher_backends[i];
+        }
+    }
+    return NULL;
+}
+
 int init()
 {
     if (get_key())
@@ -165,19 +467,281 @@ int init()
 void clean_up()
 {
     fclose(tmp_file);
+    for (int i = 0; i < nr_overlay_files; i++)
+    {
+        fclose(overlay_files[i]);
+    }
+    free(overlay_files);
+    overlay_files = NULL;
+    nr_overlay_files = 0;
     free(key);
+    free(passphrase);
     key = NULL;
+    passphrase = NULL;
+}
+
+/**
+ * Each database should have a header row where the first word should be
+ * "pastor" followed by a space and then a random number. The random number
+ * ensures a different encrypted value for each database - even when they are
+ * empty. The random number is followed by the version counter of the
+ * database and the codec of the records, which are missing in databases
+ * created before they were introduced.
+ *
+ * Returns 1 if the header is not valid and leaves the file rewound.
+ */
+int read_header(FILE* file, int* random, long* ver, int* codec)
+{
+    char tmp_buffer[1024];
+    char* token;
+    char* saveptr;
+    rewind(file);
+    if (!fgets(tmp_buffer, 1024, file))
+    {
+        return 1;
+    }
+    // strtok_r since vaults are decrypted on several threads at once.
+    token = strtok_r(tmp_buffer, " \n", &saveptr);
+    if (!token || strcmp(token, "pastor"))
+    {
+        return 1;
+    }
+    token = strtok_r(NULL, " \n", &saveptr);
+    *random = token ? atoi(token) : 0;
+    token = strtok_r(NULL, " \n", &saveptr);
+    *ver = token ? strtol(token, NULL, 10) : 0;
+    token = strtok_r(NULL, " \n", &saveptr);
+    *codec = CODEC_PLAIN;
+    if (token && !strcmp(token, codec_names[CODEC_FRONT]))
+    {
+        *codec = CODEC_FRONT;
+    }
+    else if (token && strcmp(token, codec_names[CODEC_PLAIN]))
+    {
+        return 1;
+    }
+    rewind(file);
+    return 0;
+}
+
+/**
+ * Writes the header of the database, without a trailing newline, to file.
+ */
+void write_header(FILE* file)
+{
+    fprintf(file, "pastor %d %ld %s", database_random, database_version,
+            codec_names[database_codec]);
+}
+
+/**
+ * A record of the database. On disk it is a line with the domain, the
+ * password, the version and optional fields, separated by spaces:
+ *
+ *  - "d:TIME" marks the domain as deleted at TIME, the password is then "-".
+ *  - "c:TIME" and "r:TIME" are the times the domain was created and its
+ *    password was last set.
+ *  - "a:SECONDS" is the maximum age of the password, see rotate_due.
+ *  - "h:TIME:PASSWORD" is a previous password which was replaced at TIME.
+ *    These are stored newest first and at most HISTORY_SIZE of them are kept.
+ *  - "s:SEQUENCE" is the version of this database at which the record was
+ *    merged from another replica, see merge_delta. The version of the record
+ *    is kept from the replica that wrote it since it decides which record
+ *    wins, so the sequence is what tells export_delta it changed here.
+ */
+struct record
+{
+    char* domain;
+    char* password;
+    long version;
+    char* fields;
+    long deleted;
+};
+
+/**
+ * Finds the value of the field with tag in the fields of a record.
+ *
+ * Returns 0 if there is no such field.
+ */
+long find_field(const char* fields, char tag)
+{
+    const char* field = fields;
+    while (field && *field)
+    {
+        if (field[0] == tag && field[1] == ':')
+        {
+            return strtol(field + 2, NULL, 10);
+        }
+        field = strchr(field, ' ');
+        field = field ? field + 1 : NULL;
+    }
+    return 0;
+}
+
+/**
+ * Splits a record line into its domain, password, version and fields. The
+ * line is modified in place. Records written before version counters were
+ * introduced lack the version and are treated as version 0.
+ *
+ * Returns 0 on success and 1 if the line is not a record.
+ */
+int parse_record(char* line, struct record* rec)
+{
+    char* ver_str;
+
+    line[strcspn(line, "\n")] = '\0';
+    rec->domain = strtok(line, " ");
+    rec->password = strtok(NULL, " ");
+    if (rec->domain == NULL || rec->password == NULL)
+    {
+        return 1;
+    }
+    ver_str = strtok(NULL, " ");
+    rec->version = ver_str ? strtol(ver_str, NULL, 10) : 0;
+    rec->fields = strtok(NULL, "");
+    if (!rec->fields)
+    {
+        rec->fields = "";
+    }
+    rec->deleted = find_field(rec->fields, 'd');
+    return 0;
+}
+
+/**
+ * Reads the next record from file into line and parses it. A copy of the
+ * complete record, without the newline, is kept in copy since parsing
+ * modifies line.
+ *
+ * Returns 0 on success and 1 when there are no more records.
+ */
+int next_record(FILE* file, char** line, size_t* len, char** copy,
+        struct record* rec)
+{
+    while (getline(line, len, file) != -1)
+    {
+        free(*copy);
+        *copy = strdup(*line);
+        (*copy)[strcspn(*copy, "\n")] = '\0';
+        if (!parse_record(*line, rec))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Returns the version of the database at which rec was last changed in it.
+ */
+long change_sequence(const struct record* rec)
+{
+    long sequence = find_field(rec->fields, 's');
+    return sequence > rec->version ? sequence : rec->version;
+}
+
+/**
+ * Writes the record line merged from another replica to file, without a
+ * newline, with its sequence set to sequence.
+ */
+void write_merged_record(FILE* file, const char* line, long sequence)
+{
+    struct record rec;
+    char* copy = strdup(line);
+
+    if (!parse_record(copy, &rec))
+    {
+        fprintf(file, "%s %s %ld", rec.domain, rec.password, rec.version);
+        for (char* field = strtok(rec.fields, " "); field;
+                field = strtok(NULL, " "))
+        {
+            if (strncmp(field, "s:", 2))
+            {
+                fprintf(file, " %s", field);
+            }
+        }
+        fprintf(file, " s:%ld", sequence);
+    }
+    free(copy);
+}
+
+/**
+ * Writes the record for domain with password to file, without a newline.
+ * When old_line is given the record replaces it: the old password is added
+ * first to the history and the oldest passwords are dropped so at most
+ * HISTORY_SIZE remain. A password of NULL writes a tombstone which marks the
+ * domain as deleted.
+ *
+ * The maximum age of the password is set to max_age seconds, 0 removes it and
+ * -1 keeps the one of old_line.
+ */
+void write_record(FILE* file, const char* domain, const char* password,
+        long ver, long max_age, const char* old_line)
+{
+    time_t now = time(NULL);
+    long created = now;
+    int history = 0;
+    struct record old;
+    char* old_copy = old_line ? strdup(old_line) : NULL;
+    int replaces = old_copy && !parse_record(old_copy, &old);
+
+    if (replaces && !old.deleted && find_field(old.fields, 'c'))
+    {
+        created = find_field(old.fields, 'c');
+    }
+    if (max_age == -1)
+    {
+        max_age = replaces ? find_field(old.fields, 'a') : 0;
+    }
+
+    fprintf(file, "%s %s %ld", domain, password ? password : "-", ver);
+    if (!password)
+    {
+        fprintf(file, " d:%ld", (long) now);
+    }
+    else
+    {
+        fprintf(file, " c:%ld r:%ld", created, (long) now);
+        if (max_age > 0)
+        {
+            fprintf(file, " a:%ld", max_age);
+        }
+    }
+    if (replaces)
+    {
+        if (!old.deleted)
+        {
+            fprintf(file, " h:%ld:%s", (long) now, old.password);
+            history++;
+        }
+        for (char* field = strtok(old.fields, " ");
+                field && history < HISTORY_SIZE;
+                field = strtok(NULL, " "))
+        {
+            if (!strncmp(field, "h:", 2))
+            {
+                fprintf(file, " %s", field);
+                history++;
+            }
+        }
+    }
+    free(old_copy);
 }
 
+/**
+ * Adds the password for domain to the tmp_file, keeping the records sorted on
+ * domain. A password of NULL deletes the domain by replacing its record with a
+ * tombstone.
+ *
+ * Returns 1 on error or if the domain to delete is not in the database.
+ */
 int add_to_database(const char* domain, const char* password)
 {
     ssize_t nr_bytes = -1;
     size_t len;
     char* line = NULL;
-    const char delim = ' ';
     FILE * updated_database = tmpfile();
-    char tmp_buffer[512];
     int added = 0;
+    long new_version = database_version + 1;
+    long policy = max_age->count > 0 ? (long) max_age->ival[0] * DAY : -1;
 
     rewind(tmp_file);
 
@@ -189,64 +753,99 @@ int add_to_database(const char* domain, const char* password)
     }
     else
     {
-        fwrite(line , sizeof(char), strlen(line), updated_database);
+        // The header is rewritten with the increased version counter.
+        database_version = new_version;
+        write_header(updated_database);
+        if (line[nr_bytes - 1] == '\n')
+        {
+            fputc('\n', updated_database);
+        }
     }
 
     while ((nr_bytes = getline(&line, &len, tmp_file)) != -1)
     {
-        char line_cpy[512];
-        strncpy(line_cpy, line, strlen(line));
-        char* tmp_domain = strtok(line_cpy, &delim);
-        int cmp = added ? -1 : strcmp(tmp_domain, domain);
+        size_t domain_length = strcspn(line, " \n");
+        int cmp = -1;
+        if (!added)
+        {
+            cmp = strncmp(line, domain, domain_length);
+            if (!cmp && domain[domain_length])
+            {
+                // The domain of the line is a prefix of domain.
+                cmp = -1;
+            }
+        }
+        if (password == NULL && cmp > 0)
+        {
+            // There is nothing to delete.
+            cmp = -1;
+        }
         if (cmp == 0)
         {
-            if (!(force->count))
+            struct record old;
+            char* old_copy = strdup(line);
+            int deleted = !parse_record(old_copy, &old) && old.deleted;
+            free(old_copy);
+
+            if (password == NULL && deleted)
+            {
+                // The domain is already deleted, there is nothing to delete.
+                break;
+            }
+            if (!(force->count) && !deleted)
             {
                 printf("Password for domain already in database."
-                        "Replace it? [Y/n] ");
+                        "%s it? [Y/n] ", password ? "Replace" : "Delete");
                 int character = fgetc(stdin);
                 if (character == 'n' || character == 'N')
                 {
+                    // Keeps the old record and copies the rest as is.
                     added = 1;
-                    fwrite(line , sizeof(char), strlen(line), updated_database);
-                    break;
+                    fwrite(line, sizeof(char), nr_bytes, updated_database);
+                    continue;
                 }
             }
 
             if (!added)
             {
                 added = 1;
-                if (line[strlen(line) - 1] == '\n')
+                write_record(updated_database, domain, password, new_version,
+                        policy, line);
+                if (line[nr_bytes - 1] == '\n')
                 {
-                    sprintf(tmp_buffer, "%s %s\n", domain, password);
+                    fputc('\n', updated_database);
                 }
-                else
-                {
-                    sprintf(tmp_buffer, "%s %s", domain, password);
-                }
-                fwrite(tmp_buffer, sizeof(char), strlen(tmp_buffer),
-                        updated_database);
             }
         }
         else if (cmp > 0)
         {
             added = 1;
-            sprintf(tmp_buffer, "%s %s\n", domain, password);
-            fwrite(tmp_buffer, sizeof(char), strlen(tmp_buffer), updated_database);
-            fwrite(line , sizeof(char), strlen(line), updated_database);
+            write_record(updated_database, domain, password, new_version,
+                    policy, NULL);
+            fputc('\n', updated_database);
+            fwrite(line, sizeof(char), nr_bytes, updated_database);
         }
         else
         {
-            fwrite(line , sizeof(char), strlen(line), updated_database);
+            fwrite(line, sizeof(char), nr_bytes, updated_database);
         }
     }
 
-    if (!added)
+    if (!added && password == NULL)
+    {
+        free(line);
+        fclose(updated_database);
+        fprintf(stderr, "Could not find password.\n");
+        return 1;
+    }
+    else if (!added)
     {
-        sprintf(tmp_buffer, "\n%s %s", domain, password);
-        fwrite(tmp_buffer, sizeof(char), strlen(tmp_buffer), updated_database);
+        fputc('\n', updated_database);
+        write_record(updated_database, domain, password, new_version, policy,
+                NULL);
     }
 
+    free(line);
     fclose(tmp_file);
     tmp_file = updated_database;
 
@@ -254,103 +853,597 @@ int add_to_database(const char* domain, const char* password)
 }
 
 /**
- * Encrypts the database specified with the key. Reads from the tmp_file and
- * writes to the database.
+ * Front codes the sorted domains of the records in plain. Each domain is
+ * replaced by the length of the prefix it shares with the previous domain
+ * followed by the rest of it, so www.google.com following www.github.com is
+ * stored as "5 oogle.com". The header is copied as is.
+ *
+ * Returns a new temporary file with the encoded records.
  */
-int encrypt_database()
+FILE* compress_records(FILE* plain)
 {
-    gcry_cipher_hd_t hd;
-    FILE* fpout;
-    char* buffer = calloc(sizeof(char), BUFFER_SIZE);
-    int nr_bytes = 0;
-
-    fpout = fopen(output_file->filename[0], "w");
-    rewind(tmp_file);
-
-    gcry_cipher_open(&hd, algorithm, mode, 0);
-    gcry_cipher_setkey(hd, key, 16);
+    FILE* encoded = tmpfile();
+    char* line = NULL;
+    char* previous = calloc(1, sizeof(char));
+    size_t len = 0;
 
-    while (!feof(tmp_file))
+    rewind(plain);
+    if (getline(&line, &len, plain) != -1)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        nr_bytes = fread(buffer, 1, BUFFER_SIZE, tmp_file);
-        if (!nr_bytes)
+        fputs(line, encoded);
+    }
+    while (getline(&line, &len, plain) != -1)
+    {
+        size_t domain_length = strcspn(line, " \n");
+        size_t shared = 0;
+
+        // At least one character is kept so the domain is never empty.
+        while (shared + 1 < domain_length && line[shared] == previous[shared])
         {
-            break;
+            shared++;
         }
-        gcry_cipher_encrypt(hd, buffer, BUFFER_SIZE, NULL, 0);
-        fwrite(buffer, 1, BUFFER_SIZE, fpout);
+        fprintf(encoded, "%zu %s", shared, line + shared);
+        free(previous);
+        previous = strndup(line, domain_length);
     }
 
-    gcry_cipher_close(hd);
-    fclose(fpout);
-    free(buffer);
-    return 0;
+    free(line);
+    free(previous);
+    return encoded;
 }
 
 /**
- * Decrypts the database and stores it in plain_text in the tmp_file.
+ * Reverses compress_records.
+ *
+ * Returns a new temporary file with the decoded records.
  */
-int decrypt_database()
+FILE* decompress_records(FILE* encoded)
 {
-    gcry_cipher_hd_t hd;
-    FILE* fpin;
-    char* buffer = (char*) malloc(BUFFER_SIZE);
-    int nr_bytes = 0;
-    memset(buffer, 0, BUFFER_SIZE);
+    FILE* plain = tmpfile();
+    char* line = NULL;
+    char* previous = calloc(1, sizeof(char));
+    size_t len = 0;
 
-    fpin = fopen(output_file->filename[0], "r");
-    if (!fpin)
+    rewind(encoded);
+    if (getline(&line, &len, encoded) != -1)
     {
-        printf("Database does not exist.\n");
-        return 1;
+        fputs(line, plain);
     }
+    while (getline(&line, &len, encoded) != -1)
+    {
+        char* suffix;
+        size_t shared = strtoul(line, &suffix, 10);
+        size_t suffix_length;
 
-    gcry_cipher_open(&hd, algorithm, mode, 0);
-    gcry_cipher_setkey(hd, key, 16);
+        if (suffix == line || *suffix != ' ' || shared > strlen(previous))
+        {
+            // Not a front coded record, let the parser skip it.
+            fputs(line, plain);
+            continue;
+        }
+        suffix++;
+        suffix_length = strcspn(suffix, " \n");
+        fprintf(plain, "%.*s%s", (int) shared, previous, suffix);
+        previous = realloc(previous, shared + suffix_length + 1);
+        memcpy(previous + shared, suffix, suffix_length);
+        previous[shared + suffix_length] = '\0';
+    }
+
+    free(line);
+    free(previous);
+    return plain;
+}
+
+/**
+ * Encrypts the plain text in plain with the key and writes it to filename.
+ * The records are encoded with the codec named in the header first.
+ *
+ * Databases encrypted with an AEAD backend start with a plain text line naming
+ * the backend followed by the IV, and end with the authentication tag. The
+ * line is authenticated together with the encrypted data.
+ */
+int encrypt_file(FILE* plain, const char* filename)
+{
+    gcry_cipher_hd_t hd;
+    FILE* fpout;
+    FILE* source = plain;
+    char* buffer = calloc(sizeof(char), BUFFER_SIZE);
+    char vault_header[64];
+    unsigned char iv[IV_SIZE];
+    unsigned char tag[TAG_SIZE];
+    size_t nr_bytes = 0;
+    int random, codec;
+    long ver;
+
+    // The key is derived before the database is truncated, in case that
+    // prompts for the password and is interrupted.
+    derive_key(backend, filename);
+
+    fpout = fopen(filename, "w");
+    if (!fpout)
+    {
+        fprintf(stderr, "Could not open %s for writing.\n", filename);
+        free(buffer);
+        return 1;
+    }
+
+    if (!read_header(plain, &random, &ver, &codec) && codec == CODEC_FRONT)
+    {
+        source = compress_records(plain);
+    }
+    rewind(source);
+
+    gcry_cipher_open(&hd, backend->algorithm, backend->mode, 0);
+    gcry_cipher_setkey(hd, key, backend->key_size);
+
+    if (backend->aead)
+    {
+        sprintf(vault_header, "%s %s\n", VAULT_MAGIC, backend->name);
+        gcry_randomize(iv, IV_SIZE, GCRY_STRONG_RANDOM);
+        gcry_cipher_setiv(hd, iv, IV_SIZE);
+        gcry_cipher_authenticate(hd, vault_header, strlen(vault_header));
+        fputs(vault_header, fpout);
+        fwrite(iv, 1, IV_SIZE, fpout);
+    }
+
+    while ((nr_bytes = fread(buffer, 1, BUFFER_SIZE, source)) > 0)
+    {
+        if (backend->aead)
+        {
+            // The last call to an AEAD cipher may be of any length.
+            int c = fgetc(source);
+            if (c == EOF)
+            {
+                gcry_cipher_final(hd);
+            }
+            else
+            {
+                ungetc(c, source);
+            }
+        }
+        else if (nr_bytes % backend->block_size)
+        {
+            size_t padding = backend->block_size -
+                nr_bytes % backend->block_size;
+            memset(buffer + nr_bytes, 0, padding);
+            nr_bytes += padding;
+        }
+        gcry_cipher_encrypt(hd, buffer, nr_bytes, NULL, 0);
+        fwrite(buffer, 1, nr_bytes, fpout);
+    }
+
+    if (backend->aead)
+    {
+        gcry_cipher_gettag(hd, tag, TAG_SIZE);
+        fwrite(tag, 1, TAG_SIZE, fpout);
+    }
+
+    gcry_cipher_close(hd);
+    if (source != plain)
+    {
+        fclose(source);
+    }
+    fclose(fpout);
+    free(buffer);
+    return 0;
+}
+
+/**
+ * Drops the tombstones older than TOMBSTONE_AGE from plain. Replicas which
+ * have not synced within that time may bring deleted domains back.
+ *
+ * Returns a new temporary file with the remaining records.
+ */
+FILE* collect_garbage(FILE* plain)
+{
+    FILE* collected = tmpfile();
+    char* line = NULL;
+    char* record = NULL;
+    size_t len = 0;
+    struct record rec;
+    long oldest = (long) time(NULL) - TOMBSTONE_AGE;
+
+    rewind(plain);
+    if (getline(&line, &len, plain) != -1)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        fputs(line, collected);
+    }
+    while (!next_record(plain, &line, &len, &record, &rec))
+    {
+        if (!rec.deleted || rec.deleted > oldest)
+        {
+            fprintf(collected, "\n%s", record);
+        }
+    }
+
+    free(line);
+    free(record);
+    return collected;
+}
+
+/**
+ * Encrypts the database specified with the key. Reads from the tmp_file and
+ * writes to the database.
+ */
+int encrypt_database()
+{
+    FILE* collected = collect_garbage(tmp_file);
+    fclose(tmp_file);
+    tmp_file = collected;
+    return encrypt_file(tmp_file, output_file->filename[0]);
+}
+
+/**
+ * An encrypted database being opened. open_vault reads the plain text header
+ * of the file and decrypt_vault decrypts the rest with key into plain. The
+ * latter uses no global state so several vaults can be decrypted in parallel.
+ */
+struct vault
+{
+    const char* filename;
+    FILE* encrypted;
+    const struct cipher_backend* backend;
+    char vault_header[64];
+    unsigned char iv[IV_SIZE];
+    long remaining;
+    char key[MAX_KEY_SIZE];
+    int key_cached;
+    FILE* plain;
+};
+
+/**
+ * Opens the database filename and finds its backend. Databases encrypted with
+ * an AEAD backend start with a line naming the backend followed by the IV,
+ * other databases are encrypted with the first backend.
+ *
+ * Returns 0 on success and 1 on error.
+ */
+int open_vault(struct vault* vault, const char* filename)
+{
+    FILE* fpin;
+
+    memset(vault, 0, sizeof(*vault));
+    vault->filename = filename;
+    fpin = fopen(filename, "r");
+    if (!fpin)
+    {
+        printf("Database %s does not exist.\n", filename);
+        return 1;
+    }
+
+    vault->backend = &cipher_backends[0];
+    if (fgets(vault->vault_header, sizeof(vault->vault_header), fpin) &&
+            !strncmp(vault->vault_header, VAULT_MAGIC " ",
+                strlen(VAULT_MAGIC) + 1))
+    {
+        char name[sizeof(vault->vault_header)];
+        sscanf(vault->vault_header + strlen(VAULT_MAGIC) + 1, "%63s", name);
+        if (!(vault->backend = find_backend(name)) || !vault->backend->aead ||
+                fread(vault->iv, 1, IV_SIZE, fpin) != IV_SIZE)
+        {
+            fprintf(stderr, "Unknown cipher in %s.\n", filename);
+            fclose(fpin);
+            return 1;
+        }
+    }
+    else
+    {
+        rewind(fpin);
+    }
+
+    // Only the encrypted data is read by decrypt_vault, an AEAD database ends
+    // with the tag and other databases are a whole number of blocks.
+    long start = ftell(fpin);
+    fseek(fpin, 0, SEEK_END);
+    vault->remaining = ftell(fpin) - start -
+        (vault->backend->aead ? TAG_SIZE : 0);
+    fseek(fpin, start, SEEK_SET);
+    if (vault->remaining < 0 || (!vault->backend->aead &&
+                vault->remaining % vault->backend->block_size))
+    {
+        fprintf(stderr, "Database %s is corrupted.\n", filename);
+        fclose(fpin);
+        return 1;
+    }
+    vault->encrypted = fpin;
+    return 0;
+}
+
+/**
+ * Decrypts the vault opened by open_vault with its key and decodes the records
+ * with the codec named in the header. The encrypted file is closed.
+ *
+ * Returns 0 and sets plain to a new temporary file on success.
+ */
+int decrypt_vault(struct vault* vault)
+{
+    const struct cipher_backend* cipher = vault->backend;
+    gcry_cipher_hd_t hd;
+    FILE* fpin = vault->encrypted;
+    FILE* plain = tmpfile();
+    char* buffer = (char*) malloc(BUFFER_SIZE);
+    unsigned char tag[TAG_SIZE];
+    long remaining = vault->remaining;
+    size_t nr_bytes = 0;
+    int random, codec;
+    long ver;
+
+    gcry_cipher_open(&hd, cipher->algorithm, cipher->mode, 0);
+    gcry_cipher_setkey(hd, vault->key, cipher->key_size);
+    if (cipher->aead)
+    {
+        gcry_cipher_setiv(hd, vault->iv, IV_SIZE);
+        gcry_cipher_authenticate(hd, vault->vault_header,
+                strlen(vault->vault_header));
+    }
 
-    while (!feof(fpin))
+    while (remaining > 0)
     {
-        nr_bytes = fread(buffer, 1, BUFFER_SIZE, fpin);
+        size_t to_read = BUFFER_SIZE;
+        if (remaining <= BUFFER_SIZE)
+        {
+            to_read = remaining;
+            if (cipher->aead)
+            {
+                gcry_cipher_final(hd);
+            }
+        }
+        nr_bytes = fread(buffer, 1, to_read, fpin);
         if (!nr_bytes)
         {
             break;
         }
-        gcry_cipher_decrypt(hd, buffer, BUFFER_SIZE, NULL, 0);
-        int bytes;
-        for (bytes = 0; bytes < BUFFER_SIZE; bytes++)
+        remaining -= nr_bytes;
+        gcry_cipher_decrypt(hd, buffer, nr_bytes, NULL, 0);
+        if (!cipher->aead && remaining == 0)
         {
-            if (buffer[bytes] == 0) break;
+            // Removes the zero padding of the last block only, so a zero
+            // byte elsewhere does not cut the data short.
+            while (nr_bytes > 0 && buffer[nr_bytes - 1] == '\0')
+            {
+                nr_bytes--;
+            }
         }
-        fwrite(buffer, 1, bytes, tmp_file);
+        fwrite(buffer, 1, nr_bytes, plain);
+    }
+
+    if (cipher->aead && (fread(tag, 1, TAG_SIZE, fpin) != TAG_SIZE ||
+                gcry_cipher_checktag(hd, tag, TAG_SIZE)))
+    {
+        fprintf(stderr, "Wrong key for %s or it is corrupted.\n",
+                vault->filename);
+        fclose(plain);
+        plain = NULL;
     }
 
     gcry_cipher_close(hd);
     fclose(fpin);
+    vault->encrypted = NULL;
     free(buffer);
-    return 0;
+
+    if (plain && !read_header(plain, &random, &ver, &codec) &&
+            codec == CODEC_FRONT)
+    {
+        FILE* decoded = decompress_records(plain);
+        fclose(plain);
+        plain = decoded;
+    }
+    vault->plain = plain;
+    return plain == NULL;
 }
 
 /**
- * Each database should have a header row where the first word should be
- * "pastor" followed by a space and then a random number. The random number
- * ensures a different encrypted value for each database - even when they are
- * empty.
+ * Derives the key for the vault, see derive_key. Every vault may have its own
+ * password so the key derived for an earlier vault is not reused.
  */
-int check_valid_key()
+void derive_vault_key(struct vault* vault)
 {
-    char tmp_buffer[1024];
-    rewind(tmp_file);
-    fgets(tmp_buffer, 1024, tmp_file);
-    strtok(tmp_buffer, " ");
-    if (strcmp(tmp_buffer, "pastor"))
+    key_backend = NULL;
+    derive_key(vault->backend, vault->filename);
+    memcpy(vault->key, key, MAX_KEY_SIZE);
+    vault->key_cached = key_cached;
+}
+
+/**
+ * Decrypts filename with the key and decodes the records with the codec named
+ * in the header. The backend of the file is stored in backend so the file is
+ * encrypted with the same backend again.
+ *
+ * Returns a new temporary file with the plain text or NULL on error.
+ */
+FILE* decrypt_file(const char* filename)
+{
+    struct vault vault;
+
+    if (open_vault(&vault, filename))
+    {
+        backend = DEFAULT_BACKEND;
+        return NULL;
+    }
+    backend = vault.backend;
+    derive_key(vault.backend, filename);
+    memcpy(vault.key, key, MAX_KEY_SIZE);
+    if (decrypt_vault(&vault))
+    {
+        update_key_cache(filename, key_backend, key, key_cached, 0);
+    }
+    return vault.plain;
+}
+
+/**
+ * Decrypts the database and stores it in plain_text in the tmp_file.
+ */
+int decrypt_database()
+{
+    FILE* plain = decrypt_file(output_file->filename[0]);
+    if (!plain)
     {
         return 1;
     }
-    rewind(tmp_file);
+    fclose(tmp_file);
+    tmp_file = plain;
     return 0;
 }
 
+int check_valid_key()
+{
+    int invalid = read_header(tmp_file, &database_random, &database_version,
+            &database_codec);
+    update_key_cache(output_file->filename[0], key_backend, key, key_cached,
+            !invalid);
+    return invalid;
+}
+
+/**
+ * Prompts for the key and decrypts the database into the tmp_file.
+ *
+ * Returns 0 on success. On error everything is cleaned up.
+ */
+int open_database()
+{
+    if (init())
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (decrypt_database())
+    {
+        clean_up();
+        return EXIT_FAILURE;
+    }
+
+    if (check_valid_key())
+    {
+        fprintf(stderr, "Wrong key for database.\n");
+        clean_up();
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void* decrypt_vault_thread(void* vault)
+{
+    decrypt_vault(vault);
+    return NULL;
+}
+
+/**
+ * Prompts for the keys and decrypts the database into the tmp_file and the
+ * vaults given with the vault option into the overlay_files.
+ *
+ * The keys are found one vault at a time since that may prompt the user, each
+ * vault for its own password unless it was given on the command line. The
+ * vaults are then decrypted in parallel, so opening them takes about as long
+ * as the slowest one.
+ *
+ * Returns 0 on success. On error everything is cleaned up.
+ */
+int open_overlays()
+{
+    int count = 1 + vaults->count;
+    int opened = 0;
+    int failed = 0;
+    struct vault* vault = calloc(count, sizeof(*vault));
+    pthread_t* threads = calloc(count, sizeof(*threads));
+    int* started = calloc(count, sizeof(*started));
+
+    if (init())
+    {
+        free(vault);
+        free(threads);
+        free(started);
+        return EXIT_FAILURE;
+    }
+
+    for (; opened < count; opened++)
+    {
+        const char* filename = opened == 0 ? output_file->filename[0] :
+            vaults->filename[opened - 1];
+        if (open_vault(&vault[opened], filename))
+        {
+            failed = 1;
+            break;
+        }
+        passphrase_read = database_password->count > 0;
+        derive_vault_key(&vault[opened]);
+    }
+
+    if (!failed)
+    {
+        for (int i = 1; i < count; i++)
+        {
+            started[i] = !pthread_create(&threads[i], NULL,
+                    decrypt_vault_thread, &vault[i]);
+            if (!started[i])
+            {
+                decrypt_vault(&vault[i]);
+            }
+        }
+        decrypt_vault(&vault[0]);
+        for (int i = 1; i < count; i++)
+        {
+            if (started[i])
+            {
+                pthread_join(threads[i], NULL);
+            }
+        }
+    }
+
+    overlay_files = calloc(count, sizeof(FILE*));
+    for (int i = 0; i < opened; i++)
+    {
+        int random, codec;
+        long ver;
+        int valid;
+
+        // The vaults are only decrypted when all of them could be opened.
+        if (opened < count)
+        {
+            fclose(vault[i].encrypted);
+            continue;
+        }
+
+        valid = vault[i].plain && (i == 0 ?
+                !read_header(vault[i].plain, &database_random,
+                    &database_version, &database_codec) :
+                !read_header(vault[i].plain, &random, &ver, &codec));
+        update_key_cache(vault[i].filename, vault[i].backend, vault[i].key,
+                vault[i].key_cached, valid);
+        if (vault[i].plain && !valid)
+        {
+            fprintf(stderr, "Wrong key for %s.\n", vault[i].filename);
+        }
+        failed |= !valid;
+
+        if (i == 0 && vault[i].plain)
+        {
+            fclose(tmp_file);
+            tmp_file = vault[i].plain;
+            // The key of the last vault is still in key, a later write has to
+            // use the one of the database.
+            backend = vault[i].backend;
+            key_backend = vault[i].backend;
+            memcpy(key, vault[i].key, MAX_KEY_SIZE);
+            key_cached = vault[i].key_cached;
+        }
+        else if (vault[i].plain)
+        {
+            overlay_files[nr_overlay_files++] = vault[i].plain;
+        }
+    }
+
+    free(vault);
+    free(threads);
+    free(started);
+    if (failed)
+    {
+        clean_up();
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 /**
  * Imports a password to the database.
  */
@@ -367,7 +1460,7 @@ int import_password(const char * domain, const char* password)
         return EXIT_FAILURE;
     }
 
-    char trimmed_domain[128];
+    char trimmed_domain[DOMAIN_SIZE];
     if (get_domain(domain, trimmed_domain))
     {
         fprintf(stderr, "Could not find the domain from %s.\n", domain);
@@ -413,34 +1506,27 @@ void assign_required(char* password, int password_length,
 }
 
 /**
- * Generates a new password for the specified domain.
+ * Creates a new random password following options. The random number
+ * generator has to be seeded by the caller.
  *
+ * Returns the password, which the caller frees, or NULL on error.
  */
-int generate_password(int min_size,
-        int max_size,
-        int number_of_uppercase,
-        int number_of_lowercase,
-        int number_of_digits,
-        int number_of_special_characters,
-        int len_of_special_chars,
-        char* input_special_characters,
-        int flag)
+char* create_password(const struct password_options* options)
 {
-    if (init())
-    {
-        return EXIT_FAILURE;
-    }
+    int min_size = options->min_size;
+    int max_size = options->max_size;
+    int len_of_special_chars = options->len_of_special_chars;
+    int flag = options->flag;
 
-    if ((flag & NO_DIGIT_FLAG && number_of_digits > 0) ||
+    if ((flag & NO_DIGIT_FLAG && options->number_of_digits > 0) ||
             (flag & NO_SPECIAL_CHARACTER_FLAG &&
-             number_of_special_characters > 0))
+             options->number_of_special_characters > 0))
     {
         fprintf(stderr, "Input to generate password does not make any sense, "
                 "digits or special characters cannot be both disallowed and "
                 "required.\n");
-        return 1;
+        return NULL;
     }
-    srand(time(NULL));
 
     char* valid_characters = calloc(512, sizeof(char));
     char* special_characters = calloc(256, sizeof(char));
@@ -452,13 +1538,13 @@ int generate_password(int min_size,
     strcpy(digits, "0123456789");
     if (len_of_special_chars < 1)
     {
-        strcpy(special_characters, "<>[](){}~&\"!?%/");
+        strcpy(special_characters, DEFAULT_SPECIAL_CHARACTERS);
         len_of_special_chars = strlen(special_characters);
     }
     else if (len_of_special_chars < 256)
     {
         strncpy(special_characters,
-                input_special_characters,
+                options->special_characters,
                 len_of_special_chars);
     }
     else
@@ -470,7 +1556,7 @@ int generate_password(int min_size,
         free(lowercase);
         free(uppercase);
         free(digits);
-        return 1;
+        return NULL;
     }
 
     strcpy(valid_characters, lowercase);
@@ -484,8 +1570,10 @@ int generate_password(int min_size,
         strncat(valid_characters, special_characters, len_of_special_chars);
     }
 
-    int total_requirement = number_of_digits + number_of_uppercase +
-                            number_of_lowercase + number_of_special_characters;
+    int total_requirement = options->number_of_digits +
+                            options->number_of_uppercase +
+                            options->number_of_lowercase +
+                            options->number_of_special_characters;
     if (min_size == -1)
     {
         min_size = (total_requirement > MIN_LENGTH) ? total_requirement :
@@ -521,18 +1609,21 @@ int generate_password(int min_size,
         free(lowercase);
         free(uppercase);
         free(digits);
-        return 1;
+        return NULL;
     }
 
     int length = strlen(valid_characters);
 
     char* password = calloc(password_length + 1, sizeof(char));
 
-    assign_required(password, password_length, uppercase, number_of_uppercase);
-    assign_required(password, password_length, lowercase, number_of_lowercase);
-    assign_required(password, password_length, digits, number_of_digits);
+    assign_required(password, password_length, uppercase,
+            options->number_of_uppercase);
+    assign_required(password, password_length, lowercase,
+            options->number_of_lowercase);
+    assign_required(password, password_length, digits,
+            options->number_of_digits);
     assign_required(password, password_length, special_characters,
-            number_of_special_characters);
+            options->number_of_special_characters);
 
     for(int i = 0; i < password_length; i++) {
         if (password[i] == '\0')
@@ -542,97 +1633,1135 @@ int generate_password(int min_size,
         }
     }
 
-#if DEBUG
-    printf("=DEBUG= Password: %s\n", password);
-#endif
-
-    import_password(domain->sval[0], password);
-
     free(lowercase);
     free(uppercase);
     free(digits);
     free(special_characters);
     free(valid_characters);
-    free(password);
-    clean_up();
-    return 0;
+    return password;
 }
 
 /**
- * Retrieves the password for the domain specified by the options to the
- * program.
+ * Generates a new password for the specified domain.
+ *
  */
-int fetch_password()
+int generate_password(const struct password_options* options)
 {
     if (init())
     {
         return EXIT_FAILURE;
     }
 
-    char tmp_buffer[1024];
-    char* dom;
-    char* pass;
-    int found = 0;
-    int cmp;
-    char trimmed_domain[128];
-
-    get_domain(domain->sval[0], trimmed_domain);
+    srand(time(NULL));
 
-    if (decrypt_database())
+    char* password = create_password(options);
+    if (!password)
     {
-        return EXIT_FAILURE;
+        clean_up();
+        return 1;
     }
 
-    if (check_valid_key())
+#if DEBUG
+    printf("=DEBUG= Password: %s\n", password);
+#endif
+
+    import_password(domain->sval[0], password);
+
+    free(password);
+    clean_up();
+    return 0;
+}
+
+/**
+ * Generates new passwords following options for every domain whose password is
+ * older than its maximum age, or than default_max_age seconds for domains
+ * without one. Passwords without a time they were set are always due.
+ *
+ * All due domains are found in a single pass over the records and the database
+ * is written once. The new passwords are printed as "DOMAIN PASSWORD" lines for
+ * other systems to apply.
+ */
+int rotate_due(const struct password_options* options, long default_max_age)
+{
+    if (open_database())
+    {
+        return EXIT_FAILURE;
+    }
+
+    char* line = NULL;
+    char* record = NULL;
+    size_t len = 0;
+    struct record rec;
+    long now = time(NULL);
+    long new_version = database_version + 1;
+    int rotated = 0;
+    int return_status = EXIT_FAILURE;
+    FILE* updated_database = tmpfile();
+
+    srand(time(NULL));
+    database_version = new_version;
+    write_header(updated_database);
+
+    // Skip first row.
+    getline(&line, &len, tmp_file);
+    while (!next_record(tmp_file, &line, &len, &record, &rec))
+    {
+        long age = find_field(rec.fields, 'a');
+        long set = find_field(rec.fields, 'r');
+        char* password;
+
+        if (!age)
+        {
+            age = default_max_age;
+        }
+        if (rec.deleted || age <= 0 || now - set < age)
+        {
+            fprintf(updated_database, "\n%s", record);
+            continue;
+        }
+
+        if (!(password = create_password(options)))
+        {
+            goto out;
+        }
+        fputc('\n', updated_database);
+        write_record(updated_database, rec.domain, password, new_version, -1,
+                record);
+        printf("%s %s\n", rec.domain, password);
+        free(password);
+        rotated++;
+    }
+
+    if (rotated)
+    {
+        fclose(tmp_file);
+        tmp_file = updated_database;
+        updated_database = NULL;
+        if (encrypt_database())
+        {
+            fprintf(stderr, "Could not encrypt database.\n");
+            goto out;
+        }
+    }
+    return_status = EXIT_SUCCESS;
+
+out:
+    if (updated_database)
+    {
+        fclose(updated_database);
+    }
+    free(line);
+    free(record);
+    clean_up();
+    return return_status;
+}
+
+/**
+ * Runs the helper program in argv with input on its standard input. The output
+ * of the helper is written to output, which may be NULL, and is always NUL
+ * terminated.
+ *
+ * Returns 0 if the helper ran and exited successfully.
+ */
+int run_helper(char* const argv[], const char* input, char* output,
+        size_t output_size)
+{
+    int in[2], out[2];
+    int status;
+    int write_failed = 0;
+    pid_t pid;
+    struct sigaction ignore, old_action;
+
+    if (pipe(in) || pipe(out))
+    {
+        return 1;
+    }
+
+    fflush(stdout);
+    if ((pid = fork()) == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid > 0 && input)
+    {
+        // A helper which is missing exits before reading, which would kill
+        // pastor with SIGPIPE instead of failing the write.
+        size_t total = 0;
+        size_t size = strlen(input);
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, &old_action);
+        while (total < size)
+        {
+            ssize_t nr_bytes = write(in[1], input + total, size - total);
+            if (nr_bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (nr_bytes <= 0)
+            {
+                write_failed = 1;
+                break;
+            }
+            total += nr_bytes;
+        }
+        sigaction(SIGPIPE, &old_action, NULL);
+    }
+    close(in[1]);
+
+    if (output)
+    {
+        size_t total = 0;
+        ssize_t nr_bytes;
+        while (total + 1 < output_size &&
+                (nr_bytes = read(out[0], output + total,
+                                 output_size - total - 1)) > 0)
+        {
+            total += nr_bytes;
+        }
+        output[total] = '\0';
+    }
+    close(out[0]);
+
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+    {
+        return 1;
+    }
+    return write_failed || !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/**
+ * Clears the clipboard after seconds, unless it no longer holds password.
+ *
+ * The clearing is done by a detached grandchild so pastor exits right away.
+ * Its standard streams are closed so it does not keep a pipeline reading the
+ * output of pastor open.
+ */
+void clear_clipboard_later(char* const paste[], char* const clear[],
+        const char* input, const char* password, int seconds)
+{
+    pid_t pid;
+
+    fflush(stdout);
+    if ((pid = fork()) != 0)
+    {
+        if (pid > 0)
+        {
+            waitpid(pid, NULL, 0);
+        }
+        return;
+    }
+
+    setsid();
+    if (fork() != 0)
+    {
+        _exit(0);
+    }
+
+    int null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+
+    size_t size = strlen(password) + 2;
+    char* current = calloc(size, sizeof(char));
+    sleep(seconds);
+    if (!run_helper(paste, NULL, current, size) && !strcmp(current, password))
+    {
+        run_helper(clear, input, NULL, 0);
+    }
+    _exit(0);
+}
+
+/**
+ * Writes the password to the sink given by the output option:
+ *
+ *  - "stdout" prints it, this is the default.
+ *  - "fd:N" writes it to the already open file descriptor N.
+ *  - "clipboard" copies it with wl-copy under Wayland and xclip under X11.
+ *    With the clear option the clipboard is cleared after that many seconds.
+ *  - "fifo:PATH" creates a named pipe at PATH, waits for one reader to read
+ *    the password and removes the pipe again.
+ *
+ * Returns 0 on success and 1 on error.
+ */
+int output_password(const char* password)
+{
+    const char* sink = output_sink->count > 0 ? output_sink->sval[0] :
+        "stdout";
+
+    if (!strcmp(sink, "stdout"))
+    {
+        printf("%s\n", password);
+    }
+    else if (!strncmp(sink, "fd:", 3))
+    {
+        char* end;
+        long fd;
+
+        errno = 0;
+        fd = strtol(sink + 3, &end, 10);
+        if (end == sink + 3 || *end || errno || fd < 0 || fd > INT_MAX)
+        {
+            fprintf(stderr, "Invalid file descriptor in %s.\n", sink);
+            return 1;
+        }
+        if (dprintf(fd, "%s\n", password) < 0)
+        {
+            fprintf(stderr, "Could not write to %s.\n", sink);
+            return 1;
+        }
+    }
+    else if (!strcmp(sink, "clipboard"))
+    {
+        static char* const wayland_copy[] = {"wl-copy", NULL};
+        static char* const wayland_paste[] = {"wl-paste", "--no-newline",
+            NULL};
+        static char* const wayland_clear[] = {"wl-copy", "--clear", NULL};
+        static char* const x11_copy[] = {"xclip", "-selection", "clipboard",
+            NULL};
+        static char* const x11_paste[] = {"xclip", "-selection", "clipboard",
+            "-o", NULL};
+        int wayland = getenv("WAYLAND_DISPLAY") != NULL;
+
+        if (run_helper(wayland ? wayland_copy : x11_copy, password, NULL, 0))
+        {
+            fprintf(stderr, "Could not copy the password to the clipboard.\n");
+            return 1;
+        }
+        if (clear_after->count > 0)
+        {
+            clear_clipboard_later(wayland ? wayland_paste : x11_paste,
+                    wayland ? wayland_clear : x11_copy, "", password,
+                    clear_after->ival[0]);
+        }
+    }
+    else if (!strncmp(sink, "fifo:", 5))
+    {
+        const char* path = sink + 5;
+        struct stat st;
+        int fd;
+
+        if (mkfifo(path, 0600) &&
+                (errno != EEXIST || stat(path, &st) || !S_ISFIFO(st.st_mode)))
+        {
+            fprintf(stderr, "Could not create the pipe %s.\n", path);
+            return 1;
+        }
+        // Blocks until the reader opens the pipe.
+        if ((fd = open(path, O_WRONLY)) < 0)
+        {
+            fprintf(stderr, "Could not open the pipe %s.\n", path);
+            unlink(path);
+            return 1;
+        }
+        dprintf(fd, "%s\n", password);
+        close(fd);
+        unlink(path);
+    }
+    else
+    {
+        fprintf(stderr, "Unknown output %s.\n", sink);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Finds the password for domain in the plain text file, reading the records
+ * into line.
+ *
+ * Returns the password or NULL if it is not found or deleted.
+ */
+char* lookup_password(FILE* file, const char* domain, char** line,
+        size_t* len)
+{
+    char* dom;
+    char* pass;
+    int cmp;
+
+    rewind(file);
+    // Skip first row.
+    getline(line, len, file);
+#if DEBUG
+    printf("\n=DEBUG= File contents:\n");
+#endif
+    while (getline(line, len, file) != -1)
+    {
+        dom = strtok(*line, " \n");
+        pass = strtok(NULL, " \n");
+        if (!dom || !pass)
+        {
+            continue;
+        }
+
+#if DEBUG
+        printf("\n=DEBUG= Domain: %s\n", dom);
+        printf("=DEBUG= Password: %s\n", pass);
+#endif
+        if (!(cmp = strcmp(dom, domain)))
+        {
+            // Only the matching record is checked for a tombstone.
+            strtok(NULL, " ");
+            return find_field(strtok(NULL, "\n"), 'd') ? NULL : pass;
+        }
+        else if (cmp > 0)
+        {
+            break;
+        }
+    }
+#if DEBUG
+    printf("=DEBUG=\n");
+#endif
+    return NULL;
+}
+
+/**
+ * Retrieves the password for the domain specified by the options to the
+ * program. The database is searched first and then the vaults given with the
+ * vault option, in order.
+ */
+int fetch_password()
+{
+    char* line = NULL;
+    size_t len = 0;
+    char* pass = NULL;
+    int return_status = EXIT_SUCCESS;
+    char trimmed_domain[DOMAIN_SIZE];
+
+    if (get_domain(domain->sval[0], trimmed_domain) || open_overlays())
+    {
+        return EXIT_FAILURE;
+    }
+
+    pass = lookup_password(tmp_file, trimmed_domain, &line, &len);
+    for (int i = 0; !pass && i < nr_overlay_files; i++)
+    {
+        pass = lookup_password(overlay_files[i], trimmed_domain, &line, &len);
+    }
+
+    if (pass)
+    {
+        return_status = output_password(pass) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    else
+    {
+        fprintf(stderr, "Could not find password.\n");
+    }
+
+    free(line);
+    clean_up();
+
+    return return_status;
+}
+
+/**
+ * Deletes the password for the domain specified by the options to the program.
+ * The record is replaced by a tombstone so the deletion is synced to other
+ * replicas, the password is kept in the history.
+ */
+int delete_password()
+{
+    if (open_database())
+    {
+        return EXIT_FAILURE;
+    }
+
+    char trimmed_domain[DOMAIN_SIZE];
+    int return_status = EXIT_FAILURE;
+
+    if (get_domain(domain->sval[0], trimmed_domain))
+    {
+        goto out;
+    }
+
+    if (add_to_database(trimmed_domain, NULL))
+    {
+        goto out;
+    }
+
+    if (encrypt_database())
+    {
+        fprintf(stderr, "Could not encrypt database.\n");
+        goto out;
+    }
+    return_status = EXIT_SUCCESS;
+
+out:
+    clean_up();
+    return return_status;
+}
+
+/**
+ * Prints the current and previous passwords for the domain specified by the
+ * options to the program, newest first.
+ */
+int print_history()
+{
+    if (open_database())
+    {
+        return EXIT_FAILURE;
+    }
+
+    char* line = NULL;
+    char* record = NULL;
+    size_t len = 0;
+    struct record rec;
+    int found = 0;
+    char trimmed_domain[DOMAIN_SIZE];
+    char date[64];
+    time_t when;
+
+    if (get_domain(domain->sval[0], trimmed_domain))
+    {
+        clean_up();
+        return EXIT_FAILURE;
+    }
+
+    // Skip first row.
+    getline(&line, &len, tmp_file);
+    while (!next_record(tmp_file, &line, &len, &record, &rec))
+    {
+        int cmp = strcmp(rec.domain, trimmed_domain);
+        if (cmp > 0)
+        {
+            break;
+        }
+        else if (cmp < 0)
+        {
+            continue;
+        }
+
+        found = 1;
+        if (rec.deleted)
+        {
+            when = rec.deleted;
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+                    localtime(&when));
+            printf("deleted %s\n", date);
+        }
+        else
+        {
+            printf("current %s\n", rec.password);
+        }
+        for (char* field = strtok(rec.fields, " "); field;
+                field = strtok(NULL, " "))
+        {
+            char* pass;
+            if (strncmp(field, "h:", 2))
+            {
+                continue;
+            }
+            when = strtol(field + 2, &pass, 10);
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+                    localtime(&when));
+            printf("%s %s\n", date, *pass == ':' ? pass + 1 : pass);
+        }
+        break;
+    }
+
+    if (!found)
+    {
+        fprintf(stderr, "Could not find password.\n");
+    }
+
+    free(line);
+    free(record);
+    clean_up();
+    return found ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Exports every record changed after the version since to the encrypted delta
+ * file delta_filename. The delta is itself a database holding only the changed
+ * records, so it is encrypted with the same key and can be merged into any
+ * replica with merge_delta. A since of -1 exports every record, including
+ * those of databases created before version counters which are at version 0.
+ */
+int export_delta(const char* delta_filename, long since)
+{
+    if (open_database())
+    {
+        return EXIT_FAILURE;
+    }
+
+    char* line = NULL;
+    char* record = NULL;
+    size_t len = 0;
+    struct record rec;
+    int exported = 0;
+    int return_status = EXIT_FAILURE;
+    FILE* delta = tmpfile();
+
+    write_header(delta);
+
+    // Skip first row.
+    getline(&line, &len, tmp_file);
+    while (!next_record(tmp_file, &line, &len, &record, &rec))
+    {
+        if (change_sequence(&rec) > since)
+        {
+            fprintf(delta, "\n%s", record);
+            exported++;
+        }
+    }
+
+    if (encrypt_file(delta, delta_filename))
+    {
+        fprintf(stderr, "Could not encrypt delta.\n");
+        goto out;
+    }
+
+    printf("Exported %d records up to version %ld.\n", exported,
+            database_version);
+    return_status = EXIT_SUCCESS;
+
+out:
+    free(line);
+    free(record);
+    fclose(delta);
+    clean_up();
+    return return_status;
+}
+
+/**
+ * Merges the encrypted delta file delta_filename into the database.
+ *
+ * Both the database and the delta are sorted on domain so they are merged in a
+ * single pass. When both contain a domain the record with the highest version
+ * wins and ties are broken on the password so that all replicas end up with
+ * the same record. The version counter of the database is raised past the one
+ * of the delta which makes later changes win over everything already merged.
+ * Records taken from the delta are stamped with the new version as their
+ * sequence, so the next export passes them on to the other replicas.
+ */
+int merge_delta(const char* delta_filename)
+{
+    if (init())
+    {
+        return EXIT_FAILURE;
+    }
+
+    char* lines[2] = {NULL, NULL};
+    char* records[2] = {NULL, NULL};
+    size_t lens[2] = {0, 0};
+    struct record recs[2];
+    int has[2] = {0, 0};
+    int delta_random, delta_codec;
+    long delta_version;
+    int merged = 0;
+    int return_status = EXIT_FAILURE;
+    FILE* files[2] = {NULL, NULL};
+    FILE* updated_database = tmpfile();
+    const struct cipher_backend* database_backend;
+
+    if (decrypt_database())
+    {
+        goto out;
+    }
+    // The delta may be encrypted with another backend than the database.
+    database_backend = backend;
+    files[1] = decrypt_file(delta_filename);
+    backend = database_backend;
+    if (!files[1])
+    {
+        goto out;
+    }
+
+    if (check_valid_key() ||
+            read_header(files[1], &delta_random, &delta_version,
+                &delta_codec))
+    {
+        fprintf(stderr, "Wrong key for database or delta.\n");
+        goto out;
+    }
+    files[0] = tmp_file;
+
+    if (delta_version > database_version)
+    {
+        database_version = delta_version;
+    }
+    database_version++;
+    write_header(updated_database);
+
+    // Skip first row of both files.
+    for (int i = 0; i < 2; i++)
+    {
+        getline(&lines[i], &lens[i], files[i]);
+        has[i] = !next_record(files[i], &lines[i], &lens[i], &records[i],
+                &recs[i]);
+    }
+
+    while (has[0] || has[1])
+    {
+        int cmp = !has[0] ? 1 : !has[1] ? -1 :
+            strcmp(recs[0].domain, recs[1].domain);
+        int winner = cmp < 0 ? 0 : 1;
+        if (cmp == 0 && (recs[0].version > recs[1].version ||
+                    (recs[0].version == recs[1].version &&
+                     strcmp(recs[0].password, recs[1].password) >= 0)))
+        {
+            winner = 0;
+        }
+        if (winner == 0)
+        {
+            fprintf(updated_database, "\n%s", records[0]);
+        }
+        else
+        {
+            fputc('\n', updated_database);
+            write_merged_record(updated_database, records[1],
+                    database_version);
+            merged++;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (has[i] && (cmp == 0 || i == (cmp < 0 ? 0 : 1)))
+            {
+                has[i] = !next_record(files[i], &lines[i], &lens[i],
+                        &records[i], &recs[i]);
+            }
+        }
+    }
+
+    fclose(tmp_file);
+    tmp_file = updated_database;
+    updated_database = NULL;
+
+    if (encrypt_database())
+    {
+        fprintf(stderr, "Could not encrypt database.\n");
+        goto out;
+    }
+
+    printf("Merged %d records, database is at version %ld.\n", merged,
+            database_version);
+    return_status = EXIT_SUCCESS;
+
+out:
+    for (int i = 0; i < 2; i++)
+    {
+        free(lines[i]);
+        free(records[i]);
+    }
+    if (files[1])
+    {
+        fclose(files[1]);
+    }
+    if (updated_database)
+    {
+        fclose(updated_database);
+    }
+    clean_up();
+    return return_status;
+}
+
+/**
+ * Prints value as a CSV field, quoting it when needed.
+ */
+void print_csv_field(const char* value)
+{
+    if (!value[strcspn(value, ",\"\r\n")])
+    {
+        fputs(value, stdout);
+        return;
+    }
+    putchar('"');
+    for (; *value; value++)
+    {
+        if (*value == '"')
+        {
+            putchar('"');
+        }
+        putchar(*value);
+    }
+    putchar('"');
+}
+
+/**
+ * Prints value as a JSON string.
+ */
+void print_json_string(const char* value)
+{
+    putchar('"');
+    for (; *value; value++)
+    {
+        if (*value == '"' || *value == '\\')
+        {
+            printf("\\%c", *value);
+        }
+        else if ((unsigned char) *value < 0x20)
+        {
+            printf("\\u%04x", *value);
+        }
+        else
+        {
+            putchar(*value);
+        }
+    }
+    putchar('"');
+}
+
+/**
+ * Lists the domains in the database, or exports the domains and passwords as
+ * CSV or JSON. The records are written as they are read so memory use does not
+ * depend on the size of the database.
+ */
+int list_database(int format)
+{
+    if (open_overlays())
+    {
+        return EXIT_FAILURE;
+    }
+
+    int count = 1 + nr_overlay_files;
+    FILE** files = calloc(count, sizeof(FILE*));
+    char** lines = calloc(count, sizeof(char*));
+    char** records = calloc(count, sizeof(char*));
+    size_t* lens = calloc(count, sizeof(size_t));
+    struct record* recs = calloc(count, sizeof(struct record));
+    int* has = calloc(count, sizeof(int));
+    int first = 1;
+
+    if (format == FORMAT_CSV)
+    {
+        printf("domain,password,version\n");
+    }
+    else if (format == FORMAT_JSON)
+    {
+        printf("[");
+    }
+
+    // Skip first row of every vault.
+    files[0] = tmp_file;
+    memcpy(files + 1, overlay_files, nr_overlay_files * sizeof(FILE*));
+    for (int i = 0; i < count; i++)
+    {
+        rewind(files[i]);
+        getline(&lines[i], &lens[i], files[i]);
+        has[i] = !next_record(files[i], &lines[i], &lens[i], &records[i],
+                &recs[i]);
+    }
+
+    // All vaults are sorted, so merge them. A domain is taken from the first
+    // vault in which it is not deleted, like fetching it would.
+    for (;;)
+    {
+        const char* dom = NULL;
+        struct record* rec = NULL;
+        for (int i = 0; i < count; i++)
+        {
+            if (has[i] && (!dom || strcmp(recs[i].domain, dom) < 0))
+            {
+                dom = recs[i].domain;
+            }
+        }
+        if (!dom)
+        {
+            break;
+        }
+        for (int i = 0; i < count && !rec; i++)
+        {
+            if (has[i] && !recs[i].deleted && !strcmp(recs[i].domain, dom))
+            {
+                rec = &recs[i];
+            }
+        }
+
+        if (rec && format == FORMAT_CSV)
+        {
+            print_csv_field(rec->domain);
+            putchar(',');
+            print_csv_field(rec->password);
+            printf(",%ld\n", rec->version);
+        }
+        else if (rec && format == FORMAT_JSON)
+        {
+            printf("%s\n  {\"domain\": ", first ? "" : ",");
+            print_json_string(rec->domain);
+            printf(", \"password\": ");
+            print_json_string(rec->password);
+            printf(", \"version\": %ld}", rec->version);
+        }
+        else if (rec)
+        {
+            printf("%s\n", rec->domain);
+        }
+        first &= !rec;
+
+        // The domain lives in lines of the vault it came from, so compare
+        // against a copy while advancing.
+        char* current = strdup(dom);
+        for (int i = 0; i < count; i++)
+        {
+            if (has[i] && !strcmp(recs[i].domain, current))
+            {
+                has[i] = !next_record(files[i], &lines[i], &lens[i],
+                        &records[i], &recs[i]);
+            }
+        }
+        free(current);
+    }
+
+    if (format == FORMAT_JSON)
+    {
+        printf("\n]\n");
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        free(lines[i]);
+        free(records[i]);
+    }
+    free(files);
+    free(lines);
+    free(records);
+    free(lens);
+    free(recs);
+    free(has);
+    clean_up();
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Hashes password with 64-bit FNV-1a.
+ */
+uint64_t hash_password(const char* password)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *password; password++)
+    {
+        hash = (hash ^ (unsigned char) *password) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Reports the length, character classes and entropy of every password and
+ * the passwords used for more than one domain.
+ *
+ * The character classes follow the rules of generate_password: a password
+ * without digits or special characters gets NO_DIGIT_FLAG or
+ * NO_SPECIAL_CHARACTER_FLAG, and the entropy is computed over the characters
+ * generate_password would have picked from with those flags.
+ *
+ * Reused passwords are found with an open addressing hash set of the
+ * passwords which remembers the first domain of each password. The passwords
+ * are compared when their hashes match, so a collision is not reported as
+ * reuse.
+ */
+int audit_database(const char* special_characters)
+{
+    if (open_database())
     {
-        printf("Wrong key for the database.\n");
         return EXIT_FAILURE;
     }
+
+    struct seen_password
+    {
+        uint64_t hash;
+        char* domain;
+        char* password;
+    };
+
+    char* line = NULL;
+    char* record = NULL;
+    size_t len = 0;
+    struct record rec;
+    size_t capacity = 1024;
+    size_t entries = 0;
+    int weak = 0;
+    int reused = 0;
+    int special_length = strlen(special_characters);
+    struct seen_password* seen = calloc(capacity, sizeof(*seen));
+
     // Skip first row.
-    fgets(tmp_buffer, 1024, tmp_file);
-#if DEBUG
-    printf("\n=DEBUG= File contents:\n");
-#endif
-    while (fgets(tmp_buffer, 1024, tmp_file))
+    getline(&line, &len, tmp_file);
+    while (!next_record(tmp_file, &line, &len, &record, &rec))
     {
-        dom = strtok(tmp_buffer, " ");
-        pass = strtok(NULL, " ");
+        if (rec.deleted)
+        {
+            continue;
+        }
+
+        int has_digit = 0, has_special = 0, has_other = 0;
+        int flag = 0;
+        int pool = 52;
+        int length = strlen(rec.password);
+        double entropy;
+
+        for (int i = 0; i < length; i++)
+        {
+            char c = rec.password[i];
+            if (c >= '0' && c <= '9')
+            {
+                has_digit = 1;
+            }
+            else if (strchr(special_characters, c))
+            {
+                has_special = 1;
+            }
+            else if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+            {
+                has_other = 1;
+            }
+        }
+        if (has_digit)
+        {
+            pool += 10;
+        }
+        else
+        {
+            flag |= NO_DIGIT_FLAG;
+        }
+        if (has_special)
+        {
+            pool += special_length;
+        }
+        else
+        {
+            flag |= NO_SPECIAL_CHARACTER_FLAG;
+        }
+        if (has_other)
+        {
+            // Characters the generator never uses, count all printable ASCII.
+            pool = 95;
+        }
+        entropy = length * log2(pool);
 
-        // Removes the newline.
-        if (pass[strlen(pass) - 1] == '\n')
+        printf("%s: %d characters, %.0f bits of entropy", rec.domain, length,
+                entropy);
+        if (flag & NO_DIGIT_FLAG)
+        {
+            printf(", no digits");
+        }
+        if (flag & NO_SPECIAL_CHARACTER_FLAG)
+        {
+            printf(", no special characters");
+        }
+        if (entropy < WEAK_ENTROPY)
         {
-            pass[strlen(pass) - 1] = '\0';
+            printf(", weak");
+            weak++;
         }
 
-#if DEBUG
-        printf("\n=DEBUG= Domain: %s\n", dom);
-        printf("=DEBUG= Password: %s\n", pass);
-#endif
-        if (!(cmp = strcmp(dom, trimmed_domain)))
+        // Grows the hash set to keep the load factor below a half.
+        if (2 * (entries + 1) > capacity)
         {
-            found = 1;
-            break;
+            struct seen_password* old = seen;
+            capacity *= 2;
+            seen = calloc(capacity, sizeof(*seen));
+            for (size_t i = 0; i < capacity / 2; i++)
+            {
+                if (old[i].domain)
+                {
+                    size_t slot = old[i].hash & (capacity - 1);
+                    while (seen[slot].domain)
+                    {
+                        slot = (slot + 1) & (capacity - 1);
+                    }
+                    seen[slot] = old[i];
+                }
+            }
+            free(old);
         }
-        else if (cmp > 0)
+
+        uint64_t hash = hash_password(rec.password);
+        size_t slot = hash & (capacity - 1);
+        while (seen[slot].domain && (seen[slot].hash != hash ||
+                    strcmp(seen[slot].password, rec.password)))
         {
-            break;
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (seen[slot].domain)
+        {
+            printf(", same password as %s", seen[slot].domain);
+            reused++;
+        }
+        else
+        {
+            seen[slot].hash = hash;
+            seen[slot].domain = strdup(rec.domain);
+            seen[slot].password = strdup(rec.password);
+            entries++;
         }
+        printf("\n");
     }
-#if DEBUG
-    printf("=DEBUG=\n");
-#endif
-    if (found)
+
+    printf("%d weak and %d reused passwords.\n", weak, reused);
+
+    for (size_t i = 0; i < capacity; i++)
     {
-        printf("%s\n", pass);
+        free(seen[i].domain);
+        free(seen[i].password);
     }
-    else
+    free(seen);
+    free(line);
+    free(record);
+    clean_up();
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Re-encrypts the database with the backend called name.
+ *
+ * When the key was taken from the key cache and the new backend derives its
+ * key differently the password is asked for. It is checked by deriving the
+ * key of the current backend from it, since a mistyped password would
+ * otherwise lock the database.
+ */
+int rekey_database(const char* name)
+{
+    const struct cipher_backend* new_backend = find_backend(name);
+    int return_status = EXIT_FAILURE;
+    char cached[MAX_KEY_SIZE];
+
+    if (!new_backend)
     {
-        fprintf(stderr, "Could not find password.\n");
+        fprintf(stderr, "Unknown cipher %s.\n", name);
+        return EXIT_FAILURE;
     }
 
-    clean_up();
+    if (open_database())
+    {
+        return EXIT_FAILURE;
+    }
 
-    return EXIT_SUCCESS;
+    if (key_cached && (key_backend->key_size != new_backend->key_size ||
+                key_backend->key_digest != new_backend->key_digest))
+    {
+        memcpy(cached, key, MAX_KEY_SIZE);
+        read_passphrase(output_file->filename[0]);
+        key_backend = NULL;
+        derive_key(backend, output_file->filename[0]);
+        if (memcmp(cached, key, backend->key_size))
+        {
+            fprintf(stderr, "Wrong key for database.\n");
+            goto out;
+        }
+    }
+
+    backend = new_backend;
+    if (encrypt_database())
+    {
+        fprintf(stderr, "Could not encrypt database.\n");
+        goto out;
+    }
+    return_status = EXIT_SUCCESS;
+
+out:
+    clean_up();
+    return return_status;
 }
 
 /**
@@ -640,23 +2769,28 @@ int fetch_password()
  */
 int create_new_database()
 {
-    if (init())
+    backend = DEFAULT_BACKEND;
+    if (cipher->count > 0 && !(backend = find_backend(cipher->sval[0])))
     {
+        fprintf(stderr, "Unknown cipher %s.\n", cipher->sval[0]);
         return EXIT_FAILURE;
     }
-    int bytes;
-    char buffer[1024];
-    srand(time(NULL));
-    int random = rand();
-
-    sprintf(buffer, "%s %d", "pastor", random);
 
-    for (bytes = 0; bytes < 1024; bytes++)
+    if (init())
+    {
+        return EXIT_FAILURE;
+    }
+    // A cached key could belong to an earlier database at the same path.
+    if (!passphrase_read)
     {
-        if (buffer[bytes] == 0) break;
+        read_passphrase(output_file->filename[0]);
     }
+    srand(time(NULL));
+    database_random = rand();
+    database_version = 0;
+    database_codec = compress->count > 0 ? CODEC_FRONT : CODEC_PLAIN;
 
-    fwrite(buffer, 1, bytes, tmp_file);
+    write_header(tmp_file);
 
     if (encrypt_database())
     {
@@ -668,6 +2802,65 @@ int create_new_database()
     return EXIT_SUCCESS;
 }
 
+/**
+ * Reads the options for generating passwords given to the program. The
+ * special characters in options are allocated and freed by the caller.
+ */
+void parse_password_options(struct password_options* options)
+{
+    options->number_of_lowercase = options->number_of_uppercase =
+        options->number_of_digits = options->number_of_special_characters =
+        options->flag = 0;
+    options->max_size = options->min_size = options->len_of_special_chars = -1;
+    options->special_characters = NULL;
+
+    if (min->count > 0) {
+        options->min_size = min->ival[0];
+    }
+    if (max->count > 0) {
+        options->max_size = max->ival[0];
+        if (min->count == 0)
+        {
+            options->min_size = options->max_size / 2;
+        }
+    }
+    if (number_of_uppercase->count > 0)
+    {
+        options->number_of_uppercase = number_of_uppercase->ival[0];
+    }
+    if (number_of_lowercase->count > 0)
+    {
+        options->number_of_lowercase = number_of_lowercase->ival[0];
+    }
+    if (number_of_digits->count > 0)
+    {
+        options->number_of_digits = number_of_digits->ival[0];
+    }
+    if (number_of_special_characters->count > 0)
+    {
+        options->number_of_special_characters =
+            number_of_special_characters->ival[0];
+    }
+    if (allowed_special_characters->count > 0)
+    {
+        options->len_of_special_chars =
+            strlen(allowed_special_characters->sval[0]);
+        options->special_characters =
+            calloc(options->len_of_special_chars, sizeof(char));
+        memcpy(options->special_characters,
+                allowed_special_characters->sval[0],
+                options->len_of_special_chars * sizeof(char));
+    }
+    if (no_digits->count > 0)
+    {
+        options->flag |= NO_DIGIT_FLAG;
+    }
+    if (no_special_characters->count > 0)
+    {
+        options->flag |= NO_SPECIAL_CHARACTER_FLAG;
+    }
+}
+
 void print_help(void* argtable[])
 {
     printf("Synopsis:\n");
@@ -681,10 +2874,35 @@ void argtable_setup()
     version     = arg_lit0(NULL, "version", "print version");
     help        = arg_lit0("hH", "help", "print help");
     create_new  = arg_lit0("cC", "create", "create new database");
+    list        = arg_lit0("lL", "list", "list the domains in the database");
+    export_format
+                = arg_str0(NULL, "export", "FORMAT",
+                        "export the passwords as csv or json");
+    audit       = arg_lit0(NULL, "audit", "report weak and reused passwords");
+    compress    = arg_lit0(NULL, "compress",
+                        "front code the domains of the new database");
+    cipher      = arg_str0(NULL, "cipher", "CIPHER",
+                        "cipher of the new database (blowfish-ecb, "
+                        "aes128-gcm or aes256-gcm)");
+    rekey       = arg_str0(NULL, "rekey", "CIPHER",
+                        "re-encrypt the database with CIPHER");
+    sync_export = arg_file0(NULL, "sync-export", "DELTA",
+                        "export records changed since --since to DELTA, "
+                        "or all records without --since");
+    sync_merge  = arg_file0(NULL, "sync-merge", "DELTA",
+                        "merge the records in DELTA into the database");
+    since       = arg_int0(NULL, "since", "VERSION",
+                        "version the last export was made at");
     generate    = arg_lit0("gG", "generate", "generate password");
     force       = arg_lit0("fF", "force", "force updating of password");
+    delete      = arg_lit0(NULL, "delete",
+                        "delete the password for the domain");
+    history     = arg_lit0(NULL, "history",
+                        "print the previous passwords for the domain");
     import      = arg_str0("iI", "import", "PASSWORD", "import password");
     output_file = arg_file0(NULL, NULL, "DATABASE", "database");
+    vaults      = arg_filen(NULL, "vault", "VAULT", 0, MAX_VAULTS,
+                        "also look up passwords in VAULT");
     domain      = arg_str0(NULL, NULL, "DOMAIN", "domain");
     allowed_special_characters
                 = arg_str0(NULL, "special-characters", "CHARS",
@@ -709,9 +2927,21 @@ void argtable_setup()
     no_special_characters
                 = arg_lit0(NULL, "no-special-characters",
                         "do not use special characters in password");
+    max_age     = arg_int0(NULL, "max-age", "DAYS",
+                        "days before the password is due for rotation");
+    rotate      = arg_lit0(NULL, "rotate-due",
+                        "generate new passwords for all domains which are due");
     database_password
                 = arg_str0("pP", "password", "PASSWORD",
                         "password to the datbase");
+    cache_ttl   = arg_int0(NULL, "cache", "SECONDS",
+                        "keep the key in the session keyring for SECONDS");
+    lock        = arg_lit0(NULL, "lock", "remove the key from the keyring");
+    output_sink = arg_str0("oO", "output", "SINK",
+                        "where to write the password: stdout, fd:N, "
+                        "clipboard or fifo:PATH");
+    clear_after = arg_int0(NULL, "clear", "SECONDS",
+                        "clear the clipboard after SECONDS");
     end         = arg_end(20);
 }
 
@@ -724,11 +2954,14 @@ int main(int argc, char** argv)
     int return_status = EXIT_SUCCESS;
 
     argtable_setup();
-    void* argtable[] = {version, help, create_new, generate, force,
-        allowed_special_characters, min, max, number_of_uppercase,
-        number_of_lowercase, number_of_digits, number_of_special_characters,
+    void* argtable[] = {version, help, create_new, list, export_format, audit,
+        compress, cipher, rekey, sync_export, sync_merge, since, generate,
+        force, delete, history, allowed_special_characters, min, max,
+        number_of_uppercase, number_of_lowercase, number_of_digits,
+        number_of_special_characters, max_age, rotate,
         no_digits, no_special_characters, import, database_password,
-        output_file, domain, end};
+        cache_ttl, lock, output_sink, clear_after, vaults, output_file, domain,
+        end};
 
     if (init_libgcrypt())
     {
@@ -745,6 +2978,26 @@ int main(int argc, char** argv)
         printf("\nTry pastor -h for more information on available commands.\n");
         return_status = EXIT_FAILURE;
     }
+    else if (clear_after->count > 0 && (output_sink->count == 0 ||
+                strcmp(output_sink->sval[0], "clipboard")))
+    {
+        fprintf(stderr, "Only the clipboard can be cleared, use --clear with "
+                "--output clipboard.\n");
+        return_status = EXIT_FAILURE;
+    }
+    else if (clear_after->count > 0 && clear_after->ival[0] <= 0)
+    {
+        fprintf(stderr, "The clipboard can only be cleared after a positive "
+                "number of seconds.\n");
+        return_status = EXIT_FAILURE;
+    }
+    else if (cache_ttl->count > 0 && cache_ttl->ival[0] <= 0)
+    {
+        // The keyring keeps keys with a timeout of 0 forever.
+        fprintf(stderr, "The key can only be cached for a positive number "
+                "of seconds.\n");
+        return_status = EXIT_FAILURE;
+    }
     else if (help->count > 0)
     {
         print_help(argtable);
@@ -761,79 +3014,14 @@ int main(int argc, char** argv)
 #if DEBUG
         printf("=DEBUG= Generating new password for %s.\n", domain->sval[0]);
 #endif
-        // Parsing options for generating off passwords.
-        // Maybe move this to make for a more readable main method. (its pretty
-        // cluttered as it is)
-        int min_pass_size, max_pass_size, required_lowercase,
-            required_uppercase, required_digits, required_special_characters,
-            len_of_special_chars, flag;
-        char* special_characters = NULL;
-
-        required_lowercase = required_uppercase = required_digits =
-            required_special_characters = flag = 0;
-        max_pass_size = min_pass_size = len_of_special_chars = -1;
-
-        if (min->count > 0) {
-            min_pass_size = min->ival[0];
-        }
-        if (max->count > 0) {
-            max_pass_size = max->ival[0];
-            if (min->count == 0)
-            {
-                min_pass_size = max_pass_size / 2;
-            }
-        }
-        if (number_of_uppercase->count > 0)
-        {
-            required_uppercase = number_of_uppercase->ival[0];
-        }
-        if (number_of_lowercase->count > 0)
-        {
-            required_lowercase = number_of_lowercase->ival[0];
-        }
-        if (number_of_digits->count > 0)
-        {
-            required_digits = number_of_digits->ival[0];
-        }
-        if (number_of_special_characters->count > 0)
-        {
-            required_special_characters = number_of_special_characters->ival[0];
-        }
-        if (allowed_special_characters->count > 0)
-        {
-            len_of_special_chars = strlen(allowed_special_characters->sval[0]);
-            special_characters = calloc(len_of_special_chars, sizeof(char));
-            memcpy(special_characters,
-                    allowed_special_characters->sval[0],
-                    len_of_special_chars * sizeof(char));
-        }
-        if (no_digits->count > 0)
-        {
-            flag |= NO_DIGIT_FLAG;
-        }
-        if (no_special_characters->count > 0)
-        {
-            flag |= NO_SPECIAL_CHARACTER_FLAG;
-        }
+        struct password_options options;
 
-        if (generate_password(
-                    min_pass_size,
-                    max_pass_size,
-                    required_uppercase,
-                    required_lowercase,
-                    required_digits,
-                    required_special_characters,
-                    len_of_special_chars,
-                    special_characters,
-                    flag))
+        parse_password_options(&options);
+        if (generate_password(&options))
         {
             return_status = EXIT_FAILURE;
         }
-
-        if (len_of_special_chars != -1)
-        {
-            free(special_characters);
-        }
+        free(options.special_characters);
     }
     else if (import->count > 0 && output_file->count > 0 &&
             domain->count > 0)
@@ -866,6 +3054,93 @@ int main(int argc, char** argv)
             return_status = EXIT_FAILURE;
         }
     }
+    else if (lock->count > 0 && output_file->count > 0)
+    {
+        return_status = forget_key(output_file->filename[0]);
+    }
+    else if (rotate->count > 0 && output_file->count > 0)
+    {
+        struct password_options options;
+
+        parse_password_options(&options);
+        if (rotate_due(&options, max_age->count > 0 ?
+                    (long) max_age->ival[0] * DAY : 0))
+        {
+            return_status = EXIT_FAILURE;
+        }
+        free(options.special_characters);
+    }
+    else if (delete->count > 0 && output_file->count > 0 &&
+            domain->count > 0)
+    {
+        if (delete_password())
+        {
+            return_status = EXIT_FAILURE;
+        }
+    }
+    else if (history->count > 0 && output_file->count > 0 &&
+            domain->count > 0)
+    {
+        if (print_history())
+        {
+            return_status = EXIT_FAILURE;
+        }
+    }
+    else if (list->count > 0 && output_file->count > 0)
+    {
+        if (list_database(FORMAT_LIST))
+        {
+            return_status = EXIT_FAILURE;
+        }
+    }
+    else if (export_format->count > 0 && output_file->count > 0)
+    {
+        if (!strcmp(export_format->sval[0], "csv"))
+        {
+            return_status = list_database(FORMAT_CSV);
+        }
+        else if (!strcmp(export_format->sval[0], "json"))
+        {
+            return_status = list_database(FORMAT_JSON);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown export format %s.\n",
+                    export_format->sval[0]);
+            return_status = EXIT_FAILURE;
+        }
+    }
+    else if (audit->count > 0 && output_file->count > 0)
+    {
+        if (audit_database(allowed_special_characters->count > 0 ?
+                    allowed_special_characters->sval[0] :
+                    DEFAULT_SPECIAL_CHARACTERS))
+        {
+            return_status = EXIT_FAILURE;
+        }
+    }
+    else if (rekey->count > 0 && output_file->count > 0)
+    {
+        if (rekey_database(rekey->sval[0]))
+        {
+            return_status = EXIT_FAILURE;
+        }
+    }
+    else if (sync_export->count > 0 && output_file->count > 0)
+    {
+        if (export_delta(sync_export->filename[0],
+                    since->count > 0 ? since->ival[0] : -1))
+        {
+            return_status = EXIT_FAILURE;
+        }
+    }
+    else if (sync_merge->count > 0 && output_file->count > 0)
+    {
+        if (merge_delta(sync_merge->filename[0]))
+        {
+            return_status = EXIT_FAILURE;
+        }
+    }
     else if (output_file->count > 0 && domain->count > 0)
     {
 #if DEBUG
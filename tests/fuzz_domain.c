@@ -0,0 +1,25 @@
+/**
+ * Fuzz target for get_domain. The domain it finds must fit in DOMAIN_SIZE,
+ * be a part of the URL and be usable as the first word of a record.
+ */
+#include "harness.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    char* url = strndup((const char*) data, size);
+    char out_domain[DOMAIN_SIZE];
+
+    setup_harness();
+    if (!get_domain(url, out_domain))
+    {
+        size_t length = strlen(out_domain);
+        if (length == 0 || length >= DOMAIN_SIZE || !strstr(url, out_domain) ||
+                out_domain[strcspn(out_domain, " \t\r\n/")])
+        {
+            fprintf(stderr, "Bad domain %s from %s.\n", out_domain, url);
+            abort();
+        }
+    }
+    free(url);
+    return 0;
+}
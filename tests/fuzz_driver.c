@@ -0,0 +1,63 @@
+/**
+ * Runs a fuzz target on each file given as argument, or on stdin when there
+ * are none. This is the entry point of the AFL builds and what make check
+ * replays the corpus with, libFuzzer brings its own.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+/**
+ * Reads all of file and runs the fuzz target on it.
+ *
+ * Returns 0 on success and 1 if the file could not be read.
+ */
+int run_file(FILE* file)
+{
+    uint8_t* data = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    size_t nr_bytes;
+
+    do
+    {
+        if (size == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 4096;
+            data = realloc(data, capacity);
+        }
+        nr_bytes = fread(data + size, 1, capacity - size, file);
+        size += nr_bytes;
+    }
+    while (nr_bytes > 0);
+
+    if (ferror(file))
+    {
+        free(data);
+        return 1;
+    }
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 1)
+    {
+        return run_file(stdin) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        FILE* file = fopen(argv[i], "r");
+        if (!file || run_file(file))
+        {
+            fprintf(stderr, "Could not read %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        fclose(file);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/**
+ * Fuzz target for parse_record and add_to_database. The first line of the
+ * input is a domain and the rest the records of a database. Every record has
+ * to parse into words, and the domain has to be added, found and deleted
+ * again whatever the records look like.
+ */
+#include "harness.h"
+
+#define FUZZ_PASSWORD "fuzz-password"
+
+/**
+ * Checks that the records of tmp_file parse into words without spaces.
+ *
+ * Returns 1 if the domains are strictly increasing and every line is a
+ * record, so lookup_password can be relied on.
+ */
+int check_records()
+{
+    char* line = NULL;
+    char* record = NULL;
+    char* previous = NULL;
+    size_t len = 0;
+    struct record rec;
+    int sorted = 1;
+
+    rewind(tmp_file);
+    getline(&line, &len, tmp_file);
+    while (!next_record(tmp_file, &line, &len, &record, &rec))
+    {
+        if (!*rec.domain || !*rec.password ||
+                rec.domain[strcspn(rec.domain, " \n")] ||
+                rec.password[strcspn(rec.password, " \n")])
+        {
+            fprintf(stderr, "Bad record %s.\n", record);
+            abort();
+        }
+        // Words after leading spaces or a NUL are not what add_to_database
+        // compares against.
+        sorted &= record[0] != ' ' && strlen(record) > strlen(rec.domain) &&
+            (!previous || strcmp(previous, rec.domain) < 0);
+        free(previous);
+        previous = strdup(rec.domain);
+    }
+
+    // A line the parser skipped is not a record either.
+    rewind(tmp_file);
+    getline(&line, &len, tmp_file);
+    while (sorted && getline(&line, &len, tmp_file) != -1)
+    {
+        sorted = !parse_record(line, &rec);
+    }
+
+    free(line);
+    free(record);
+    free(previous);
+    return sorted;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    const uint8_t* newline = memchr(data, '\n', size);
+    size_t domain_length = newline ? (size_t) (newline - data) : size;
+    char* domain = strndup((const char*) data, domain_length);
+    size_t rest = newline ? size - domain_length - 1 : 0;
+    int sorted;
+    char* line = NULL;
+    size_t len = 0;
+    char* pass;
+
+    // The domain has to be one get_domain could have returned.
+    if (!*domain || strlen(domain) != domain_length ||
+            domain_length >= DOMAIN_SIZE || domain[strcspn(domain, " \t\r\n")])
+    {
+        free(domain);
+        domain = strdup("example.com");
+    }
+
+    setup_harness();
+    if (init())
+    {
+        abort();
+    }
+    fclose(tmp_file);
+    tmp_file = make_database(CODEC_PLAIN, data + size - rest, rest);
+    sorted = check_records();
+
+    if (add_to_database(domain, FUZZ_PASSWORD))
+    {
+        fprintf(stderr, "Could not add %s.\n", domain);
+        abort();
+    }
+    check_records();
+    pass = lookup_password(tmp_file, domain, &line, &len);
+    if (sorted && (!pass || strcmp(pass, FUZZ_PASSWORD)))
+    {
+        fprintf(stderr, "Added %s but found %s.\n", domain, pass);
+        abort();
+    }
+
+    if (add_to_database(domain, NULL))
+    {
+        fprintf(stderr, "Could not delete %s.\n", domain);
+        abort();
+    }
+    check_records();
+    pass = lookup_password(tmp_file, domain, &line, &len);
+    if (sorted && pass)
+    {
+        fprintf(stderr, "Deleted %s but found %s.\n", domain, pass);
+        abort();
+    }
+    if (!add_to_database(domain, NULL))
+    {
+        fprintf(stderr, "Deleted %s twice.\n", domain);
+        abort();
+    }
+
+    free(line);
+    free(domain);
+    clean_up();
+    return 0;
+}
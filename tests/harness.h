@@ -0,0 +1,72 @@
+/**
+ * Shared setup of the fuzz targets and property tests.
+ *
+ * pastor is a single program, so it is built into each test with its main
+ * renamed. The tests then call its functions and set its options directly.
+ */
+#define main pastor_main
+#include "../pastor.c"
+#undef main
+
+// The database encrypt_file and decrypt_file are tested against.
+char harness_database[] = "/tmp/pastor-test-XXXXXX";
+
+void remove_harness_database()
+{
+    unlink(harness_database);
+}
+
+/**
+ * Sets up libgcrypt and the options as if pastor was run with --force and
+ * --password, so nothing is ever prompted for. Only the first call does
+ * anything.
+ */
+void setup_harness()
+{
+    static int done;
+    int fd;
+
+    if (done)
+    {
+        return;
+    }
+    done = 1;
+
+    if (init_libgcrypt())
+    {
+        abort();
+    }
+    argtable_setup();
+    force->count = 1;
+    database_password->count = 1;
+    database_password->sval[0] = "harness";
+
+    fd = mkstemp(harness_database);
+    if (fd == -1)
+    {
+        perror("mkstemp");
+        abort();
+    }
+    close(fd);
+    output_file->count = 1;
+    output_file->filename[0] = harness_database;
+    atexit(remove_harness_database);
+}
+
+/**
+ * Writes a database header with codec followed by size bytes of records to a
+ * new temporary file. Like a database it has no trailing newline when there
+ * are no records.
+ */
+FILE* make_database(int codec, const uint8_t* data, size_t size)
+{
+    FILE* plain = tmpfile();
+    fprintf(plain, "pastor 1 0 %s", codec_names[codec]);
+    if (size > 0)
+    {
+        fputc('\n', plain);
+        fwrite(data, 1, size, plain);
+    }
+    rewind(plain);
+    return plain;
+}
@@ -0,0 +1,183 @@
+/**
+ * Property test of add_to_database and lookup_password. Random domains are
+ * added, replaced and deleted in bulk while a reference map of what each
+ * domain should hold is kept, and lookup_password has to agree with the map
+ * for every domain. The database is then encrypted and decrypted with every
+ * backend and codec and checked again.
+ *
+ * The seed can be given as the first argument to reproduce a failure.
+ */
+#include "harness.h"
+
+#define NR_DOMAINS 600
+#define NR_OPERATIONS 3000
+
+/**
+ * A domain of the reference map and the password it should have. A domain
+ * which was never added or is deleted is not present.
+ */
+struct entry
+{
+    char domain[DOMAIN_SIZE];
+    char password[16];
+    int present;
+};
+
+struct entry entries[NR_DOMAINS];
+
+/**
+ * Writes a random domain to domain. The alphabet is small and the domains
+ * short so many of them share prefixes or are prefixes of each other.
+ */
+void random_domain(char* domain)
+{
+    const char alphabet[] = "ab.-9";
+    int length = 1 + rand() % 12;
+
+    for (int i = 0; i < length; i++)
+    {
+        domain[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    domain[length] = '\0';
+}
+
+/**
+ * Checks lookup_password against the reference map for every domain.
+ *
+ * Returns the number of domains which do not match.
+ */
+int check_lookups(const char* when)
+{
+    char* line = NULL;
+    size_t len = 0;
+    int failures = 0;
+
+    for (int i = 0; i < NR_DOMAINS; i++)
+    {
+        char* pass = lookup_password(tmp_file, entries[i].domain, &line, &len);
+        const char* expected = entries[i].present ? entries[i].password : NULL;
+
+        if ((pass == NULL) != (expected == NULL) ||
+                (pass && strcmp(pass, expected)))
+        {
+            fprintf(stderr, "%s: found %s for %s instead of %s.\n", when,
+                    pass ? pass : "nothing", entries[i].domain,
+                    expected ? expected : "nothing");
+            failures++;
+        }
+    }
+    free(line);
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int seed = argc > 1 ? strtoul(argv[1], NULL, 10) : time(NULL);
+    int failures = 0;
+    int nr_domains = 0;
+
+    srand(seed);
+    setup_harness();
+
+    // Distinct domains, so the map is a plain array.
+    while (nr_domains < NR_DOMAINS)
+    {
+        int duplicate = 0;
+
+        random_domain(entries[nr_domains].domain);
+        for (int i = 0; i < nr_domains && !duplicate; i++)
+        {
+            duplicate = !strcmp(entries[i].domain, entries[nr_domains].domain);
+        }
+        nr_domains += !duplicate;
+    }
+
+    if (init())
+    {
+        return EXIT_FAILURE;
+    }
+    fclose(tmp_file);
+    tmp_file = make_database(CODEC_PLAIN, NULL, 0);
+
+    for (int op = 0; op < NR_OPERATIONS; op++)
+    {
+        struct entry* entry = &entries[rand() % NR_DOMAINS];
+
+        if (rand() % 4 == 0)
+        {
+            // Deleting a domain which is missing or deleted has to fail.
+            if (add_to_database(entry->domain, NULL) != !entry->present)
+            {
+                fprintf(stderr, "Deleting %s did not match the map.\n",
+                        entry->domain);
+                failures++;
+            }
+            entry->present = 0;
+        }
+        else
+        {
+            snprintf(entry->password, sizeof(entry->password), "p%d", op);
+            if (add_to_database(entry->domain, entry->password))
+            {
+                fprintf(stderr, "Could not add %s.\n", entry->domain);
+                failures++;
+            }
+            entry->present = 1;
+        }
+        if (op % 500 == 0)
+        {
+            failures += check_lookups("While adding");
+        }
+    }
+    failures += check_lookups("After adding");
+
+    for (size_t i = 0;
+            i < sizeof(cipher_backends) / sizeof(cipher_backends[0]); i++)
+    {
+        for (int codec = CODEC_PLAIN; codec <= CODEC_FRONT; codec++)
+        {
+            FILE* plain = tmpfile();
+            FILE* decrypted;
+            char* line = NULL;
+            size_t len = 0;
+            char when[64];
+
+            // The header names the codec the records are encoded with.
+            database_codec = codec;
+            write_header(plain);
+            rewind(tmp_file);
+            getline(&line, &len, tmp_file);
+            while (getline(&line, &len, tmp_file) != -1)
+            {
+                fprintf(plain, "\n%.*s", (int) strcspn(line, "\n"), line);
+            }
+            free(line);
+            fclose(tmp_file);
+            tmp_file = plain;
+
+            backend = &cipher_backends[i];
+            decrypted = encrypt_database() ? NULL :
+                decrypt_file(harness_database);
+            if (!decrypted)
+            {
+                fprintf(stderr, "Could not decrypt with %s.\n", backend->name);
+                failures++;
+                continue;
+            }
+            fclose(tmp_file);
+            tmp_file = decrypted;
+            snprintf(when, sizeof(when), "After %s and codec %s",
+                    cipher_backends[i].name, codec_names[codec]);
+            failures += check_lookups(when);
+        }
+    }
+
+    clean_up();
+    if (failures)
+    {
+        fprintf(stderr, "%d failures with seed %u.\n", failures, seed);
+        return EXIT_FAILURE;
+    }
+    printf("All lookups matched with seed %u.\n", seed);
+    return EXIT_SUCCESS;
+}